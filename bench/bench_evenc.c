@@ -0,0 +1,459 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Bytes and CPU time per second of the event encodings, for a recorded
+ * session.
+ *
+ * Replays a session on a fake serial device, once for each combination of
+ * protocol version and event encoding, with a number of clients connected,
+ * and reports the bytes each client received, per event and per second, and
+ * the CPU time used by the daemon per second of session.
+ *
+ * Sessions are recorded from a running daemon with a real device (-r), as
+ * raw input frames and button changes. Without a session file, a synthetic
+ * one is generated: a mix of single axis pans, combined motion, rest, and
+ * button presses.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "proto.h"
+#include "client.h"
+#include "benchutil.h"
+
+#define READ_BUF_SIZE	65536
+
+struct sample {
+	long long time;		/* usec from the start of the session */
+	int axes[6];
+	unsigned int bnstate;
+};
+
+struct reader {
+	int s;
+	unsigned char *buf;
+	int len;
+	long long bytes, events;
+};
+
+static int record(const char *fname, int sec);
+static int load_session(const char *fname);
+static int gen_session(void);
+static int add_sample(long long time, const int *axes, unsigned int bnstate);
+static int run(int proto, int enc);
+static void read_client(struct reader *rd, int proto, int enc);
+static int parse_events(struct reader *rd, int proto, int enc);
+static void print_usage(const char *argv0);
+
+static const char *daemon_path = "../spacenavd";
+static int nclients = 16;
+static double speed = 1.0;
+
+static struct sample *session;
+static int num_samples, max_samples;
+
+static struct fakedev dev;
+static pid_t daemon_pid;
+
+int main(int argc, char **argv)
+{
+	int i, rec_sec = 30;
+	const char *fname = 0, *recfile = 0;
+
+	for(i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-d") == 0 && argv[i + 1]) {
+			daemon_path = argv[++i];
+		} else if(strcmp(argv[i], "-f") == 0 && argv[i + 1]) {
+			fname = argv[++i];
+		} else if(strcmp(argv[i], "-r") == 0 && argv[i + 1]) {
+			recfile = argv[++i];
+		} else if(strcmp(argv[i], "-t") == 0 && argv[i + 1]) {
+			rec_sec = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-n") == 0 && argv[i + 1]) {
+			nclients = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-x") == 0 && argv[i + 1]) {
+			speed = atof(argv[++i]);
+		} else {
+			print_usage(argv[0]);
+			return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+		}
+	}
+	if(nclients <= 0 || speed <= 0.0 || rec_sec <= 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if(recfile) {
+		return record(recfile, rec_sec) == -1 ? 1 : 0;
+	}
+
+	if((fname ? load_session(fname) : gen_session()) == -1) {
+		return 1;
+	}
+	if(num_samples < 2) {
+		fprintf(stderr, "session too short\n");
+		return 1;
+	}
+	printf("session: %d samples, %.1f sec, replayed at %gx, %d clients\n", num_samples,
+			session[num_samples - 1].time / 1000000.0, speed, nclients);
+
+	if(fakedev_open(&dev) == -1) {
+		return 1;
+	}
+	if((daemon_pid = start_daemon(daemon_path, &dev, 0)) == -1) {
+		fakedev_close(&dev);
+		return 1;
+	}
+
+	printf("encoding     events  bytes/event  bytes/s/client  daemon cpu ms/s\n");
+	run(1, EVENC_DEFAULT);
+	run(1, EVENC_COMPACT);
+	run(2, EVENC_DEFAULT);
+	run(2, EVENC_COMPACT);
+
+	stop_daemon(daemon_pid);
+	fakedev_close(&dev);
+	return 0;
+}
+
+/* Records raw input frames and button changes from the running daemon. The
+ * session file has a line per sample: time in usec, 6 raw axis values, and
+ * the button state in hex.
+ */
+static int record(const char *fname, int sec)
+{
+	int s, i, data[6] = {EVMASK_RAWFRAME | EVMASK_RAWBUTTON};
+	int axes[6] = {0};
+	unsigned int bnstate = 0;
+	long long t0, now, end;
+	struct reqresp ev;
+	struct pollfd pfd;
+	FILE *fp;
+
+	if((s = connect_client(1)) == -1) {
+		return -1;
+	}
+	if(client_request(s, 1, REQ_SET_EVMASK, data) == -1) {
+		fprintf(stderr, "failed to select raw events\n");
+		close(s);
+		return -1;
+	}
+	if(!(fp = fopen(fname, "w"))) {
+		perror(fname);
+		close(s);
+		return -1;
+	}
+	fprintf(fp, "# spacenavd session: usec, 6 raw axes, buttons\n");
+
+	printf("recording for %d seconds, move the device ...\n", sec);
+	t0 = usec_now();
+	end = t0 + sec * 1000000LL;
+	pfd.fd = s;
+	pfd.events = POLLIN;
+
+	while((now = usec_now()) < end) {
+		if(poll(&pfd, 1, (end - now) / 1000 + 1) <= 0) continue;
+		if(recv(s, &ev, sizeof ev, MSG_WAITALL) != sizeof ev) {
+			fprintf(stderr, "lost the connection to the daemon\n");
+			break;
+		}
+		if(ev.type == UEV_RAWFRAME) {
+			for(i=0; i<6; i++) {
+				axes[i] = (int16_t)(ev.data[3 + i / 2] >> (i & 1 ? 16 : 0));
+			}
+		} else if(ev.type == UEV_RAWBUTTON && ev.data[0] >= 0 && ev.data[0] < 32) {
+			if(ev.data[1]) {
+				bnstate |= 1u << ev.data[0];
+			} else {
+				bnstate &= ~(1u << ev.data[0]);
+			}
+		} else {
+			continue;
+		}
+		fprintf(fp, "%lld %d %d %d %d %d %d %x\n", usec_now() - t0, axes[0], axes[1],
+				axes[2], axes[3], axes[4], axes[5], bnstate);
+	}
+
+	fclose(fp);
+	close(s);
+	return 0;
+}
+
+static int load_session(const char *fname)
+{
+	FILE *fp;
+	char buf[256];
+	long long time;
+	int axes[6];
+	unsigned int bnstate;
+
+	if(!(fp = fopen(fname, "r"))) {
+		perror(fname);
+		return -1;
+	}
+	while(fgets(buf, sizeof buf, fp)) {
+		if(buf[0] == '#') continue;
+		if(sscanf(buf, "%lld %d %d %d %d %d %d %x", &time, axes, axes + 1, axes + 2,
+					axes + 3, axes + 4, axes + 5, &bnstate) != 8) {
+			continue;
+		}
+		if(add_sample(time, axes, bnstate) == -1) {
+			fclose(fp);
+			return -1;
+		}
+	}
+	fclose(fp);
+	return 0;
+}
+
+/* 20 seconds at 125Hz: alternating single axis pans, combined motion and rest,
+ * with a button press every 2 seconds.
+ */
+static int gen_session(void)
+{
+	int i, j, phase, axes[6];
+	unsigned int bnstate;
+	double t, env;
+
+	for(i=0; i<2500; i++) {
+		t = i / 125.0;
+		phase = (int)(t / 2.5) % 4;
+		env = sin(fmod(t, 2.5) / 2.5 * M_PI);
+
+		memset(axes, 0, sizeof axes);
+		switch(phase) {
+		case 0:		/* pan along one axis */
+			axes[(int)(t / 10.0) % 3] = (int)(300.0 * env);
+			break;
+		case 1:		/* combined translation and rotation */
+			for(j=0; j<6; j++) {
+				axes[j] = (int)(250.0 * env * sin(t * (1.0 + j * 0.3)));
+			}
+			break;
+		case 2:		/* twist, with some crosstalk on the other axes */
+			axes[4] = (int)(350.0 * env);
+			axes[3] = (int)(20.0 * env * sin(t * 7.0));
+			axes[5] = (int)(15.0 * env * cos(t * 5.0));
+			break;
+		default:	/* at rest */
+			break;
+		}
+		bnstate = fmod(t, 2.0) < 0.15 ? 1 : 0;
+
+		if(add_sample(i * 8000LL, axes, bnstate) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int add_sample(long long time, const int *axes, unsigned int bnstate)
+{
+	struct sample *tmp;
+	int newsz;
+
+	if(num_samples >= max_samples) {
+		newsz = max_samples ? max_samples * 2 : 1024;
+		if(!(tmp = realloc(session, newsz * sizeof *session))) {
+			fprintf(stderr, "failed to allocate session buffer\n");
+			return -1;
+		}
+		session = tmp;
+		max_samples = newsz;
+	}
+	session[num_samples].time = time;
+	memcpy(session[num_samples].axes, axes, sizeof session->axes);
+	session[num_samples].bnstate = bnstate;
+	num_samples++;
+	return 0;
+}
+
+static int run(int proto, int enc)
+{
+	int i, j, res = -1, data[6];
+	struct reader *readers;
+	struct pollfd *pfd;
+	struct sample *prev = 0, *smp;
+	long long t0, now, due, cpu0, cpu, bytes = 0, events = 0;
+	double dur;
+
+	if(!(readers = calloc(nclients, sizeof *readers)) || !(pfd = malloc(nclients * sizeof *pfd))) {
+		free(readers);
+		fprintf(stderr, "failed to allocate memory for %d clients\n", nclients);
+		return -1;
+	}
+	for(i=0; i<nclients; i++) {
+		readers[i].s = -1;
+	}
+
+	for(i=0; i<nclients; i++) {
+		if((readers[i].s = connect_client(proto)) == -1 ||
+				!(readers[i].buf = malloc(READ_BUF_SIZE))) {
+			goto end;
+		}
+		memset(data, 0, sizeof data);
+		data[0] = EVMASK_MOTION | EVMASK_BUTTON;
+		client_request(readers[i].s, proto, REQ_SET_EVMASK, data);
+		data[0] = enc;
+		if(client_request(readers[i].s, proto, REQ_SET_EVENC, data) != 0) {
+			fprintf(stderr, "failed to set the event encoding\n");
+			goto end;
+		}
+		pfd[i].fd = readers[i].s;
+		pfd[i].events = POLLIN;
+	}
+	usleep(100000);
+
+	cpu0 = proc_cpu_usec(daemon_pid);
+	t0 = usec_now();
+
+	for(i=0; i<num_samples; i++) {
+		smp = session + i;
+		due = t0 + (long long)(smp->time / speed);
+
+		/* read whatever arrived while waiting for the next sample */
+		while((now = usec_now()) < due) {
+			if(poll(pfd, nclients, (due - now) / 1000) > 0) {
+				for(j=0; j<nclients; j++) {
+					if(pfd[j].revents & POLLIN) {
+						read_client(readers + j, proto, enc);
+					}
+				}
+			}
+		}
+
+		if(!prev || memcmp(prev->axes, smp->axes, sizeof smp->axes) != 0) {
+			fakedev_motion(&dev, smp->axes);
+		}
+		if(!prev || prev->bnstate != smp->bnstate) {
+			fakedev_buttons(&dev, smp->bnstate);
+		}
+		prev = smp;
+	}
+	/* bring the device to rest, and collect the remaining events */
+	memset(data, 0, sizeof data);
+	fakedev_motion(&dev, data);
+	fakedev_buttons(&dev, 0);
+
+	now = usec_now();
+	while(poll(pfd, nclients, 200) > 0) {
+		for(j=0; j<nclients; j++) {
+			if(pfd[j].revents & POLLIN) {
+				read_client(readers + j, proto, enc);
+			}
+		}
+	}
+	cpu = proc_cpu_usec(daemon_pid) - cpu0;
+	dur = (now - t0) / 1000000.0;
+	fakedev_drain(&dev);
+
+	for(i=0; i<nclients; i++) {
+		bytes += readers[i].bytes;
+		events += readers[i].events;
+	}
+	bytes /= nclients;
+	events /= nclients;
+
+	printf("v%d %-8s %8lld %12.1f %15.0f %16.2f\n", proto, enc == EVENC_COMPACT ? "compact" : "default",
+			events, events ? (double)bytes / events : 0.0, bytes / dur, cpu / 1000.0 / dur);
+	fflush(stdout);
+	res = 0;
+
+end:
+	for(i=0; i<nclients; i++) {
+		if(readers[i].s >= 0) close(readers[i].s);
+		free(readers[i].buf);
+	}
+	free(readers);
+	free(pfd);
+	usleep(100000);
+	return res;
+}
+
+static void read_client(struct reader *rd, int proto, int enc)
+{
+	int sz, used;
+
+	if((sz = recv(rd->s, rd->buf + rd->len, READ_BUF_SIZE - rd->len, MSG_DONTWAIT)) <= 0) {
+		return;
+	}
+	rd->bytes += sz;
+	rd->len += sz;
+
+	used = parse_events(rd, proto, enc);
+	rd->len -= used;
+	if(rd->len > 0) {
+		memmove(rd->buf, rd->buf + used, rd->len);
+	}
+}
+
+/* counts the complete events in the buffer, returns the bytes consumed */
+static int parse_events(struct reader *rd, int proto, int enc)
+{
+	int i, pos = 0, sz;
+	unsigned int bits;
+	struct frame_hdr *fhdr;
+
+	for(;;) {
+		if(proto >= 2) {
+			if(rd->len - pos < sizeof *fhdr) break;
+			fhdr = (struct frame_hdr*)(rd->buf + pos);
+			if(rd->len - pos < fhdr->size) break;
+			rd->events += fhdr->count;
+			pos += fhdr->size;
+
+		} else if(enc == EVENC_COMPACT) {
+			/* tag, bitmap, and a varint for each bit set */
+			if(rd->len - pos < 2) break;
+			sz = 2;
+			bits = rd->buf[pos + 1];
+			for(i=0; i<7; i++) {
+				if(!(bits & (1 << i))) continue;
+				do {
+					if(pos + sz >= rd->len) return pos;
+				} while(rd->buf[pos + sz++] & 0x80);
+			}
+			rd->events++;
+			pos += sz;
+
+		} else {
+			if(rd->len - pos < sizeof(struct reqresp)) break;
+			rd->events++;
+			pos += sizeof(struct reqresp);
+		}
+	}
+	return pos;
+}
+
+static void print_usage(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("options:\n");
+	printf(" -d <path>: spacenavd binary (default: %s)\n", daemon_path);
+	printf(" -f <file>: replay a recorded session (default: a synthetic 20 sec session)\n");
+	printf(" -n <num>: number of clients (default: %d)\n", nclients);
+	printf(" -x <factor>: replay speed (default: 1)\n");
+	printf(" -r <file>: record a session from the running daemon instead\n");
+	printf(" -t <sec>: length of the recording (default: 30)\n");
+	printf(" -h: print usage information and exit\n");
+}
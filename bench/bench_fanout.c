@@ -0,0 +1,235 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Delivery latency against client count, with and without fan-out threads.
+ *
+ * Starts the daemon on a fake serial device once for each fan-out thread
+ * count, connects an increasing number of protocol v1 clients, and sends one
+ * motion packet at a time, waiting for every client to receive the motion
+ * event before sending the next. Latency is measured from the write to the
+ * device, to the event arriving at each client.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "proto.h"
+#include "client.h"
+#include "benchutil.h"
+
+#define MAX_COUNTS	16
+
+static int parse_list(const char *str, int *list);
+static int run(int nclients, int threads);
+static int cmp_ll(const void *a, const void *b);
+static void print_usage(const char *argv0);
+
+static const char *daemon_path = "../spacenavd";
+static int nrounds = 500;
+static struct fakedev dev;
+
+int main(int argc, char **argv)
+{
+	int i, j, ncounts, nthr;
+	int counts[MAX_COUNTS] = {1, 16, 64, 256};
+	int threads[MAX_COUNTS] = {0, 0};
+	pid_t pid;
+	char extra[64];
+
+	ncounts = 4;
+	if((threads[1] = sysconf(_SC_NPROCESSORS_ONLN)) < 2) {
+		threads[1] = 2;
+	}
+	nthr = 2;
+
+	for(i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-d") == 0 && argv[i + 1]) {
+			daemon_path = argv[++i];
+		} else if(strcmp(argv[i], "-n") == 0 && argv[i + 1]) {
+			if((ncounts = parse_list(argv[++i], counts)) <= 0) {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "-t") == 0 && argv[i + 1]) {
+			if((nthr = parse_list(argv[++i], threads)) <= 0) {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else if(strcmp(argv[i], "-r") == 0 && argv[i + 1]) {
+			if((nrounds = atoi(argv[++i])) <= 0) {
+				print_usage(argv[0]);
+				return 1;
+			}
+		} else {
+			print_usage(argv[0]);
+			return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+		}
+	}
+
+	if(fakedev_open(&dev) == -1) {
+		return 1;
+	}
+
+	printf("%d rounds, latency in usec\n", nrounds);
+	printf("threads clients    mean     p50     p99     max   last(mean)\n");
+
+	for(i=0; i<nthr; i++) {
+		sprintf(extra, "fanout-threads = %d", threads[i]);
+		if((pid = start_daemon(daemon_path, &dev, extra)) == -1) {
+			fakedev_close(&dev);
+			return 1;
+		}
+		for(j=0; j<ncounts; j++) {
+			if(run(counts[j], threads[i]) == -1) {
+				break;
+			}
+		}
+		stop_daemon(pid);
+	}
+
+	fakedev_close(&dev);
+	return 0;
+}
+
+static int parse_list(const char *str, int *list)
+{
+	int count = 0;
+	char *endp;
+
+	while(*str && count < MAX_COUNTS) {
+		list[count++] = strtol(str, &endp, 10);
+		if(endp == str || list[count - 1] < 0) {
+			return -1;
+		}
+		str = *endp == ',' ? endp + 1 : endp;
+	}
+	return count;
+}
+
+static int run(int nclients, int threads)
+{
+	int i, j, s, res = -1, pending;
+	int *socks;
+	struct pollfd *pfd;
+	long long *lat, *last, t0, sum = 0, lastsum = 0;
+	int axes[6] = {0};
+	int nsamples = 0;
+	struct reqresp ev;
+
+	socks = malloc(nclients * sizeof *socks);
+	pfd = malloc(nclients * sizeof *pfd);
+	lat = malloc(nclients * nrounds * sizeof *lat);
+	last = malloc(nrounds * sizeof *last);
+	if(!socks || !pfd || !lat || !last) {
+		fprintf(stderr, "failed to allocate memory for %d clients\n", nclients);
+		goto end;
+	}
+
+	for(i=0; i<nclients; i++) {
+		if((socks[i] = connect_client(1)) == -1) {
+			nclients = i;
+			goto end;
+		}
+	}
+	/* the default event mask of v1 clients also has buttons and devices */
+	for(i=0; i<nclients; i++) {
+		int data[6] = {EVMASK_MOTION};
+		client_request(socks[i], 1, REQ_SET_EVMASK, data);
+	}
+	usleep(100000);
+
+	for(i=0; i<nrounds; i++) {
+		/* alternate values, so that every packet is a change of state */
+		axes[0] = i & 1 ? 200 : 100;
+
+		for(j=0; j<nclients; j++) {
+			pfd[j].fd = socks[j];
+			pfd[j].events = POLLIN;
+		}
+		pending = nclients;
+
+		t0 = usec_now();
+		fakedev_motion(&dev, axes);
+
+		while(pending > 0) {
+			if(poll(pfd, nclients, 1000) <= 0) {
+				fprintf(stderr, "timeout waiting for events (%d clients, %d threads)\n",
+						nclients, threads);
+				goto end;
+			}
+			for(j=0; j<nclients; j++) {
+				if(pfd[j].fd < 0 || !(pfd[j].revents & POLLIN)) continue;
+
+				s = pfd[j].fd;
+				if(recv(s, &ev, sizeof ev, MSG_WAITALL) != sizeof ev) {
+					fprintf(stderr, "client %d disconnected\n", j);
+					goto end;
+				}
+				if(ev.type != UEV_MOTION) continue;
+
+				lat[nsamples] = usec_now() - t0;
+				sum += lat[nsamples++];
+				pfd[j].fd = -1;
+				pending--;
+			}
+		}
+		last[i] = usec_now() - t0;
+		lastsum += last[i];
+		fakedev_drain(&dev);
+	}
+
+	qsort(lat, nsamples, sizeof *lat, cmp_ll);
+	printf("%7d %7d %7lld %7lld %7lld %7lld %10lld\n", threads, nclients, sum / nsamples,
+			lat[nsamples / 2], lat[nsamples * 99 / 100], lat[nsamples - 1], lastsum / nrounds);
+	fflush(stdout);
+	res = 0;
+
+end:
+	if(socks) {
+		for(i=0; i<nclients; i++) {
+			close(socks[i]);
+		}
+	}
+	free(socks);
+	free(pfd);
+	free(lat);
+	free(last);
+	/* let the daemon notice the disconnections */
+	usleep(100000);
+	return res;
+}
+
+static int cmp_ll(const void *a, const void *b)
+{
+	long long x = *(long long*)a, y = *(long long*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void print_usage(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("options:\n");
+	printf(" -d <path>: spacenavd binary (default: %s)\n", daemon_path);
+	printf(" -n <list>: comma-separated client counts (default: 1,16,64,256)\n");
+	printf(" -t <list>: comma-separated fan-out thread counts (default: 0,<num cpus, at least 2>)\n");
+	printf(" -r <num>: motion packets per run (default: %d)\n", nrounds);
+	printf(" -h: print usage information and exit\n");
+}
@@ -0,0 +1,256 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* Memory cost of the per-client work during event fan-out, with the client
+ * record layout of the daemon headers it's built against.
+ *
+ * Lays out client records in slabs as client.c does, links them into a
+ * default subscriber list in random order (clients come and go, so the list
+ * doesn't follow memory order), and for each event walks the list touching
+ * the fields that dispatch and the protocol v1 send path use for every
+ * client. Reports the number of distinct cache lines these fields span, and
+ * the time and cache misses per client per event. Cache misses come from the
+ * hardware counters, where the kernel allows it.
+ */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include "client.h"
+#include "benchutil.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define CLIENT_SLAB_SIZE	32
+#define LINE_SIZE			64
+
+/* as in client.c */
+struct client_slab {
+	struct client clients[CLIENT_SLAB_SIZE];
+	struct client_cold cold[CLIENT_SLAB_SIZE];
+	struct client_slab *next;
+};
+
+static int count_lines(void);
+static struct client_sub *make_clients(int count);
+static long long fanout_pass(struct client_sub *list);
+static int open_miss_counter(void);
+static long long read_counter(int fd);
+static void print_usage(const char *argv0);
+
+static int nclients = 16384;
+static int nevents = 200;
+
+int main(int argc, char **argv)
+{
+	int i, fd;
+	struct client_sub *list;
+	long long t0, dt, misses0 = 0, misses = 0, sum = 0;
+
+	for(i=1; i<argc; i++) {
+		if(strcmp(argv[i], "-n") == 0 && argv[i + 1]) {
+			nclients = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-e") == 0 && argv[i + 1]) {
+			nevents = atoi(argv[++i]);
+		} else {
+			print_usage(argv[0]);
+			return strcmp(argv[i], "-h") == 0 ? 0 : 1;
+		}
+	}
+	if(nclients <= 0 || nevents <= 0) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	if(!(list = make_clients(nclients))) {
+		fprintf(stderr, "failed to allocate %d clients\n", nclients);
+		return 1;
+	}
+
+	printf("struct client: %d bytes, struct client_cold: %d bytes\n",
+			(int)sizeof(struct client), (int)sizeof(struct client_cold));
+	printf("fan-out fields span %d cache lines\n", count_lines());
+
+	fanout_pass(list);	/* warm up */
+
+	fd = open_miss_counter();
+	if(fd != -1) misses0 = read_counter(fd);
+	t0 = usec_now();
+	for(i=0; i<nevents; i++) {
+		sum += fanout_pass(list);
+	}
+	dt = usec_now() - t0;
+	if(fd != -1) {
+		misses = read_counter(fd) - misses0;
+		close(fd);
+	}
+
+	printf("%d clients, %d events: %.2f ns per client per event\n", nclients, nevents,
+			dt * 1000.0 / ((double)nclients * nevents));
+	if(fd != -1) {
+		printf("cache misses: %.3f per client per event\n", (double)misses / ((double)nclients * nevents));
+	} else {
+		printf("cache misses: hardware counters not available\n");
+	}
+	return sum == 0;	/* keep the passes from being optimized out */
+}
+
+/* fields touched for every client and event, see fanout_pass */
+#define FIELD(x)	{offsetof(struct client, x), sizeof ((struct client*)0)->x}
+static const struct {
+	int offs, size;
+} fields[] = {
+	FIELD(type), FIELD(evmask), FIELD(sens), FIELD(deliv_mode), FIELD(slow),
+	FIELD(dead), FIELD(shard), FIELD(proto), FIELD(evenc), FIELD(ring),
+	FIELD(filter_on), FIELD(num_events), FIELD(cold),
+	FIELD(defsub.client), FIELD(defsub.next[SUB_MOTION]),
+	FIELD(outq.count), FIELD(outq.limit), FIELD(outq.stalled), FIELD(outq.motion_size)
+};
+#define NUM_FIELDS	(sizeof fields / sizeof *fields)
+
+static int count_lines(void)
+{
+	int i, j, count = 0;
+	char used[(sizeof(struct client) + LINE_SIZE - 1) / LINE_SIZE] = {0};
+
+	for(i=0; i<NUM_FIELDS; i++) {
+		for(j=fields[i].offs / LINE_SIZE; j<=(fields[i].offs + fields[i].size - 1) / LINE_SIZE; j++) {
+			if(!used[j]) {
+				used[j] = 1;
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+static struct client_sub *make_clients(int count)
+{
+	int i, j, nslabs;
+	struct client_slab *slabs;
+	struct client **order, *tmp;
+	struct client_sub *list = 0;
+
+	nslabs = (count + CLIENT_SLAB_SIZE - 1) / CLIENT_SLAB_SIZE;
+	if(!(slabs = calloc(nslabs, sizeof *slabs)) || !(order = malloc(count * sizeof *order))) {
+		return 0;
+	}
+	for(i=0; i<count; i++) {
+		struct client *c = slabs[i / CLIENT_SLAB_SIZE].clients + i % CLIENT_SLAB_SIZE;
+		c->cold = slabs[i / CLIENT_SLAB_SIZE].cold + i % CLIENT_SLAB_SIZE;
+		c->type = CLIENT_UNIX;
+		c->proto = 1;
+		c->sens = 1.0f;
+		c->shard = -1;
+		c->evmask = EVMASK_MOTION | EVMASK_BUTTON | EVMASK_DEV;
+		c->outq.limit = 8192;
+		c->defsub.client = c;
+		order[i] = c;
+	}
+
+	srand(1);
+	for(i=count-1; i>0; i--) {
+		j = rand() % (i + 1);
+		tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+	for(i=0; i<count; i++) {
+		order[i]->defsub.next[SUB_MOTION] = list;
+		list = &order[i]->defsub;
+	}
+	free(order);
+	return list;
+}
+
+/* what dispatch and send_uevent_enc/send_uevmotion/send_umotion read and
+ * write for a protocol v1 client receiving a motion event.
+ */
+static long long fanout_pass(struct client_sub *list)
+{
+	struct client_sub *sub;
+	struct client *c;
+	long long sum = 0;
+
+	for(sub=list; sub; sub=sub->next[SUB_MOTION]) {
+		c = sub->client;
+		if(c->shard != -1) continue;
+		if(!(c->evmask & EVMASK_MOTION) || c->ring || c->slow) continue;
+		if(c->deliv_mode != DELIV_DEFAULT || c->filter_on) continue;
+		if(c->type != CLIENT_UNIX || c->dead || c->evenc != EVENC_DEFAULT) continue;
+
+		sum += (long long)(c->sens * c->proto);
+		c->num_events++;
+		if(c->outq.stalled) {
+			c->outq.motion_size = 32;
+		} else if((c->outq.count += 32) > c->outq.limit) {
+			c->outq.count = 0;
+		}
+		sum += c->cold != 0;
+	}
+	return sum;
+}
+
+#ifdef __linux__
+static int open_miss_counter(void)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof attr);
+	attr.size = sizeof attr;
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = PERF_COUNT_HW_CACHE_MISSES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long read_counter(int fd)
+{
+	long long val;
+	if(read(fd, &val, sizeof val) != sizeof val) {
+		return 0;
+	}
+	return val;
+}
+#else
+static int open_miss_counter(void)
+{
+	return -1;
+}
+
+static long long read_counter(int fd)
+{
+	return 0;
+}
+#endif
+
+static void print_usage(const char *argv0)
+{
+	printf("usage: %s [options]\n", argv0);
+	printf("options:\n");
+	printf(" -n <num>: number of clients (default: %d)\n", nclients);
+	printf(" -e <num>: number of events (default: %d)\n", nevents);
+	printf(" -h: print usage information and exit\n");
+}
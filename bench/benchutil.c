@@ -0,0 +1,376 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#define _GNU_SOURCE	/* posix_openpt and friends, cfmakeraw */
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "spnavd.h"
+#include "proto.h"
+#include "benchutil.h"
+
+static char tmpdir[64];
+static char cfgpath[96], logpath[96], pidpath[96];
+
+int fakedev_open(struct fakedev *dev)
+{
+	struct termios term;
+	char *name;
+
+	if((dev->master = posix_openpt(O_RDWR | O_NOCTTY)) == -1) {
+		perror("posix_openpt");
+		return -1;
+	}
+	if(grantpt(dev->master) == -1 || unlockpt(dev->master) == -1 ||
+			!(name = ptsname(dev->master))) {
+		perror("failed to set up pseudo-terminal");
+		close(dev->master);
+		return -1;
+	}
+	strncpy(dev->path, name, sizeof dev->path - 1);
+	dev->path[sizeof dev->path - 1] = 0;
+
+	/* keep the slave open, so that the master doesn't see a hangup when the
+	 * daemon closes and reopens the device.
+	 */
+	if((dev->slave = open(dev->path, O_RDWR | O_NOCTTY)) == -1) {
+		perror(dev->path);
+		close(dev->master);
+		return -1;
+	}
+	if(tcgetattr(dev->master, &term) != -1) {
+		cfmakeraw(&term);
+		tcsetattr(dev->master, TCSANOW, &term);
+	}
+	return 0;
+}
+
+void fakedev_close(struct fakedev *dev)
+{
+	close(dev->slave);
+	close(dev->master);
+}
+
+int fakedev_handshake(struct fakedev *dev, long timeout_msec)
+{
+	static const char *verstr = "vMAGELLAN  Version 6.70  3Dconnexion GmbH 05/11/00 \r";
+	char buf[256];
+	int sz, len = 0;
+	long long end = usec_now() + timeout_msec * 1000LL;
+	struct pollfd pfd;
+
+	pfd.fd = dev->master;
+	pfd.events = POLLIN;
+
+	while(usec_now() < end) {
+		if(poll(&pfd, 1, 100) <= 0) continue;
+		if((sz = read(dev->master, buf + len, sizeof buf - len - 1)) <= 0) {
+			continue;
+		}
+		len += sz;
+		buf[len] = 0;
+		/* the daemon tries the spaceball reset first, which we ignore */
+		if(strstr(buf, "vQ")) {
+			write(dev->master, verstr, strlen(verstr));
+			return 0;
+		}
+		if(len > sizeof buf / 2) {
+			memmove(buf, buf + len - 4, 4);
+			len = 4;
+		}
+	}
+	return -1;
+}
+
+static void put_nibbles(char *ptr, unsigned int val, int count)
+{
+	while(count-- > 0) {
+		*ptr++ = 0x30 | ((val >> (count * 4)) & 0xf);
+	}
+}
+
+int fakedev_motion(struct fakedev *dev, const int *axes)
+{
+	int i;
+	char pkt[26];
+
+	pkt[0] = 'd';
+	for(i=0; i<6; i++) {
+		put_nibbles(pkt + 1 + i * 4, (axes[i] + 0x8000) & 0xffff, 4);
+	}
+	pkt[25] = '\r';
+	return write(dev->master, pkt, sizeof pkt) == sizeof pkt ? 0 : -1;
+}
+
+int fakedev_buttons(struct fakedev *dev, unsigned int bnstate)
+{
+	char pkt[5];
+
+	pkt[0] = 'k';
+	put_nibbles(pkt + 1, bnstate & 0xf, 1);
+	put_nibbles(pkt + 2, (bnstate >> 4) & 0xf, 1);
+	put_nibbles(pkt + 3, (bnstate >> 8) & 0xf, 1);
+	pkt[4] = '\r';
+	return write(dev->master, pkt, sizeof pkt) == sizeof pkt ? 0 : -1;
+}
+
+void fakedev_drain(struct fakedev *dev)
+{
+	char buf[256];
+	struct pollfd pfd;
+
+	pfd.fd = dev->master;
+	pfd.events = POLLIN;
+	while(poll(&pfd, 1, 0) > 0 && read(dev->master, buf, sizeof buf) > 0);
+}
+
+static int daemon_running(void)
+{
+	int s, res;
+	struct sockaddr_un addr;
+
+	if((s = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
+		return 0;
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SOCK_NAME, sizeof addr.sun_path - 1);
+	res = connect(s, (struct sockaddr*)&addr, sizeof addr) == 0;
+	close(s);
+	return res;
+}
+
+pid_t start_daemon(const char *path, struct fakedev *dev, const char *extra_cfg)
+{
+	pid_t pid;
+	FILE *fp;
+	int i;
+
+	if(daemon_running()) {
+		fprintf(stderr, "another spacenavd is running, stop it first\n");
+		return -1;
+	}
+
+	if(!*tmpdir) {
+		strcpy(tmpdir, "/tmp/spnavbench.XXXXXX");
+		if(!mkdtemp(tmpdir)) {
+			perror("failed to create temporary directory");
+			*tmpdir = 0;
+			return -1;
+		}
+		sprintf(cfgpath, "%s/spnavrc", tmpdir);
+		sprintf(logpath, "%s/spnavd.log", tmpdir);
+		sprintf(pidpath, "%s/spnavd.pid", tmpdir);
+	}
+
+	if(!(fp = fopen(cfgpath, "w"))) {
+		perror(cfgpath);
+		return -1;
+	}
+	fprintf(fp, "serial = %s\n", dev->path);
+	if(extra_cfg) {
+		fputs(extra_cfg, fp);
+		fputc('\n', fp);
+	}
+	fclose(fp);
+
+	if((pid = fork()) == -1) {
+		perror("fork");
+		return -1;
+	}
+	if(!pid) {
+		execl(path, path, "-d", "-c", cfgpath, "-l", logpath, "-p", pidpath, (char*)0);
+		perror(path);
+		_exit(1);
+	}
+
+	if(fakedev_handshake(dev, 10000) == -1) {
+		fprintf(stderr, "the daemon didn't query the fake device, see %s\n", logpath);
+		stop_daemon(pid);
+		return -1;
+	}
+	for(i=0; i<100; i++) {
+		if(daemon_running()) break;
+		usleep(50000);
+	}
+	if(i >= 100) {
+		fprintf(stderr, "the daemon didn't start accepting clients, see %s\n", logpath);
+		stop_daemon(pid);
+		return -1;
+	}
+	/* let it finish setting up the device */
+	usleep(300000);
+	fakedev_drain(dev);
+	return pid;
+}
+
+void stop_daemon(pid_t pid)
+{
+	kill(pid, SIGTERM);
+	waitpid(pid, 0, 0);
+
+	if(*tmpdir) {
+		unlink(cfgpath);
+		unlink(logpath);
+		unlink(pidpath);
+		rmdir(tmpdir);
+		*tmpdir = 0;
+	}
+}
+
+int connect_client(int proto)
+{
+	int s;
+	int32_t msg;
+	struct sockaddr_un addr;
+
+	if((s = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, SOCK_NAME, sizeof addr.sun_path - 1);
+	if(connect(s, (struct sockaddr*)&addr, sizeof addr) == -1) {
+		perror("failed to connect to the daemon");
+		close(s);
+		return -1;
+	}
+
+	if(proto > 0) {
+		msg = REQ_TAG | REQ_CHANGE_PROTO | proto;
+		if(write(s, &msg, sizeof msg) != sizeof msg || read(s, &msg, sizeof msg) != sizeof msg ||
+				(msg & 0xff) != proto) {
+			fprintf(stderr, "failed to switch to protocol v%d\n", proto);
+			close(s);
+			return -1;
+		}
+	}
+	return s;
+}
+
+static int recv_all(int s, void *buf, int size)
+{
+	return recv(s, buf, size, MSG_WAITALL) == size ? 0 : -1;
+}
+
+/* next response in a protocol v2 frame stream, skipping events */
+static int recv_resp_v2(int s, struct reqresp *rr)
+{
+	struct frame_hdr fhdr;
+	struct rec_hdr *rec;
+	char *buf, *ptr;
+	int found = 0;
+
+	while(!found) {
+		if(recv_all(s, &fhdr, sizeof fhdr) == -1 || fhdr.size < sizeof fhdr ||
+				!(buf = malloc(fhdr.size))) {
+			return -1;
+		}
+		if(recv_all(s, buf, fhdr.size - sizeof fhdr) == -1) {
+			free(buf);
+			return -1;
+		}
+		ptr = buf;
+		while(ptr < buf + fhdr.size - sizeof fhdr) {
+			rec = (struct rec_hdr*)ptr;
+			if(rec->size < sizeof *rec) break;
+			if(rec->type == REC_RESPONSE && !found) {
+				memcpy(rr, rec + 1, sizeof *rr);
+				found = 1;
+			}
+			ptr += rec->size;
+		}
+		free(buf);
+	}
+	return 0;
+}
+
+int client_request(int s, int proto, int req, int *data)
+{
+	struct reqresp rr;
+	int i;
+
+	memset(&rr, 0, sizeof rr);
+	rr.type = req;
+	for(i=0; i<6; i++) {
+		rr.data[i] = data[i];
+	}
+	if(write(s, &rr, sizeof rr) != sizeof rr) {
+		return -1;
+	}
+	/* skip any events queued before the response */
+	do {
+		if(proto >= 2) {
+			if(recv_resp_v2(s, &rr) == -1) {
+				return -1;
+			}
+		} else if(recv_all(s, &rr, sizeof rr) == -1) {
+			return -1;
+		}
+	} while((rr.type & 0xffff) != req);
+
+	for(i=0; i<6; i++) {
+		data[i] = rr.data[i];
+	}
+	return rr.data[6];
+}
+
+long long usec_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+long long proc_cpu_usec(pid_t pid)
+{
+	FILE *fp;
+	char buf[512], *ptr;
+	unsigned long utime, stime;
+	char path[64];
+
+	sprintf(path, "/proc/%d/stat", (int)pid);
+	if(!(fp = fopen(path, "r"))) {
+		return -1;
+	}
+	if(!fgets(buf, sizeof buf, fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	/* skip past the command name, which can contain spaces */
+	if(!(ptr = strrchr(buf, ')'))) {
+		return -1;
+	}
+	if(sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+		return -1;
+	}
+	return (utime + stime) * 1000000LL / sysconf(_SC_CLK_TCK);
+}
@@ -0,0 +1,61 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef BENCHUTIL_H_
+#define BENCHUTIL_H_
+
+#include <sys/types.h>
+
+/* Fake Magellan serial device on a pseudo-terminal. The daemon is pointed at
+ * the slave side with the serial option, and the benchmarks write motion and
+ * button packets to the master side.
+ */
+struct fakedev {
+	int master, slave;
+	char path[64];
+};
+
+int fakedev_open(struct fakedev *dev);
+void fakedev_close(struct fakedev *dev);
+/* answers the version query of the daemon, returns -1 on timeout */
+int fakedev_handshake(struct fakedev *dev, long timeout_msec);
+/* 6 axis values in the device range */
+int fakedev_motion(struct fakedev *dev, const int *axes);
+int fakedev_buttons(struct fakedev *dev, unsigned int bnstate);
+/* discard anything the daemon sent to the device */
+void fakedev_drain(struct fakedev *dev);
+
+/* Starts the daemon on the fake device, with any extra config lines, and
+ * waits until it accepts clients. Config, log and pid files go in a temporary
+ * directory, which is removed by stop_daemon.
+ */
+pid_t start_daemon(const char *path, struct fakedev *dev, const char *extra_cfg);
+void stop_daemon(pid_t pid);
+
+/* connects to the daemon and switches to the requested protocol version */
+int connect_client(int proto);
+/* Sends a request with data[0-5], and waits for the response, which is
+ * returned in data. Returns the response status. Doesn't understand the
+ * compact encoding, make any requests before switching to it.
+ */
+int client_request(int s, int proto, int req, int *data);
+
+long long usec_now(void);
+/* user and system CPU time used by a process so far, in microseconds */
+long long proc_cpu_usec(pid_t pid);
+
+#endif	/* BENCHUTIL_H_ */
@@ -45,6 +45,9 @@ enum {
 	CFG_AXISMAP_N, CFG_BNMAP_N, CFG_BNACT_N, CFG_KBMAP_N,
 	CFG_LED, CFG_GRAB,
 	CFG_SERIAL, CFG_DEVID,
+	CFG_QUEUE_LIMIT, CFG_SLOW_POLICY, CFG_CLIENT_FLUSH,
+	CFG_FANOUT_THREADS, CFG_BACKLOG, CFG_MAX_USER_CLIENTS, CFG_X11_FOCUS,
+	CFG_STATS_FILE,
 
 	/* debug options, not part of the protocol, can change at any time */
 	CFG_KBMAP_USE_X11,
@@ -113,6 +116,14 @@ void default_cfg(struct cfg *cfg)
 
 	cfg->repeat_msec = -1;
 
+	cfg->client_queue_limit = 8192;
+	cfg->slow_client_policy = SLOW_DEGRADE;
+	cfg->client_flush = FLUSH_LOOP;
+	cfg->listen_backlog = 64;
+	cfg->max_clients_per_user = 0;
+	cfg->x11_focus = 0;
+	cfg->stats_file[0] = 0;
+
 	for(i=0; i<MAX_CUSTOM; i++) {
 		cfg->devname[i] = 0;
 		cfg->devid[i][0] = cfg->devid[i][1] = -1;
@@ -469,6 +480,63 @@ int read_cfg(const char *fname, struct cfg *cfg)
 				continue;
 			}
 
+		} else if(strcmp(key_str, "client-queue-limit") == 0) {
+			lptr->opt = CFG_QUEUE_LIMIT;
+			EXPECT(isint && ival >= 256);
+			cfg->client_queue_limit = ival;
+
+		} else if(strcmp(key_str, "slow-client-policy") == 0) {
+			lptr->opt = CFG_SLOW_POLICY;
+			if(strcmp(val_str, "degrade") == 0) {
+				cfg->slow_client_policy = SLOW_DEGRADE;
+			} else if(strcmp(val_str, "disconnect") == 0) {
+				cfg->slow_client_policy = SLOW_DISCONNECT;
+			} else {
+				logmsg(LOG_WARNING, "invalid configuration value for %s, expected \"degrade\" or \"disconnect\".\n", key_str);
+				continue;
+			}
+
+		} else if(strcmp(key_str, "listen-backlog") == 0) {
+			lptr->opt = CFG_BACKLOG;
+			EXPECT(isint && ival > 0);
+			cfg->listen_backlog = ival;
+
+		} else if(strcmp(key_str, "max-clients-per-user") == 0) {
+			lptr->opt = CFG_MAX_USER_CLIENTS;
+			EXPECT(isint && ival >= 0);
+			cfg->max_clients_per_user = ival;
+
+		} else if(strcmp(key_str, "x11-focus-delivery") == 0) {
+			lptr->opt = CFG_X11_FOCUS;
+			if(isint || isbool) {
+				cfg->x11_focus = ival;
+			} else {
+				logmsg(LOG_WARNING, "invalid configuration value for %s, expected a boolean value.\n", key_str);
+				continue;
+			}
+
+		} else if(strcmp(key_str, "stats-file") == 0) {
+			lptr->opt = CFG_STATS_FILE;
+			strncpy(cfg->stats_file, val_str, PATH_MAX - 1);
+
+		} else if(strcmp(key_str, "fanout-threads") == 0) {
+			lptr->opt = CFG_FANOUT_THREADS;
+			EXPECT(isint && ival >= 0);
+			cfg->fanout_threads = ival;
+
+		} else if(strcmp(key_str, "client-flush") == 0) {
+			lptr->opt = CFG_CLIENT_FLUSH;
+			if(strcmp(val_str, "immediate") == 0) {
+				cfg->client_flush = FLUSH_IMMEDIATE;
+			} else if(strcmp(val_str, "frame") == 0) {
+				cfg->client_flush = FLUSH_FRAME;
+			} else if(strcmp(val_str, "loop") == 0) {
+				cfg->client_flush = FLUSH_LOOP;
+			} else {
+				logmsg(LOG_WARNING, "invalid configuration value for %s, expected \"immediate\", \"frame\", or \"loop\".\n", key_str);
+				continue;
+			}
+
 		} else {
 			logmsg(LOG_WARNING, "unrecognized config option: %s\n", key_str);
 		}
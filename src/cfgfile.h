@@ -26,6 +26,19 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define MAX_CUSTOM		64
 #define MAX_KEYS_PER_BUTTON	8
 
+/* what to do with clients which can't keep up with the event stream */
+enum {
+	SLOW_DEGRADE,		/* skip raw events, and drop events over the queue limit */
+	SLOW_DISCONNECT		/* disconnect the client when the queue limit is reached */
+};
+
+/* when queued client output is written to the sockets */
+enum {
+	FLUSH_IMMEDIATE,	/* as soon as each message is generated */
+	FLUSH_FRAME,		/* after each complete device input frame */
+	FLUSH_LOOP			/* once per main loop iteration */
+};
+
 enum {
 	LED_OFF		= 0,
 	LED_ON		= 1,
@@ -60,6 +73,15 @@ struct cfg {
 	char serial_dev[PATH_MAX];
 	int repeat_msec;
 
+	int client_queue_limit;		/* max bytes of output queued per client */
+	int slow_client_policy;
+	int client_flush;			/* FLUSH_* */
+	int fanout_threads;			/* client delivery worker threads (0: none) */
+	int listen_backlog;
+	int max_clients_per_user;	/* 0: unlimited */
+	int x11_focus;				/* deliver motion only to the focused X11 client */
+	char stats_file[PATH_MAX];	/* Prometheus text file for the counters, or empty */
+
 	char *devname[MAX_CUSTOM];	/* custom USB device name list */
 	int devid[MAX_CUSTOM][2];	/* custom USB vendor/product id list */
 
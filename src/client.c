@@ -19,17 +19,69 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "client.h"
 #include "dev.h"
 #include "spnavd.h"
+#include "fanout.h"
+#include "shm.h"
+#include "metrics.h"
 
 #ifdef USE_X11
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #endif
 
+/* Client records are allocated from slabs, and recycled through a free list.
+ * Removed clients stay in the client list as zombies until reap_clients is
+ * called at the end of the main loop iteration, so that iterating over the
+ * list is always safe, even if clients are removed in the process.
+ */
+#define CLIENT_SLAB_SIZE	32
+
+struct client_slab {
+	struct client clients[CLIENT_SLAB_SIZE];
+	struct client_cold cold[CLIENT_SLAB_SIZE];
+	struct client_slab *next;
+};
+
+static struct client_slab *slabs;
+static struct client *free_clients;
+
 static struct client *client_list = NULL;
-static struct client *client_iter;	/* iterator (used by first/next calls) */
+static struct client *zombies;
+static int num_clients;
+
+/* active client arbitration (REQ_SET_ACTIVE) */
+static struct client *active_client;
+static unsigned int active_flags;
+
+/* UNIX clients indexed by socket */
+static struct client **sock_index;
+static int sock_index_size;
+
+#ifdef USE_X11
+/* X11 clients indexed by window */
+#define WIN_HASH_SIZE	256
+#define WIN_HASH(w)		((unsigned int)((w) ^ ((w) >> 8)) % WIN_HASH_SIZE)
+static struct client *win_hash[WIN_HASH_SIZE];
+#endif
+
+static struct client *alloc_client(void);
+static void free_client(struct client *client);
+static int index_client(struct client *client);
+static void unindex_client(struct client *client);
+
+/* subscriber lists for the default device */
+static struct client_sub *default_subs[NUM_SUB_CLASSES];
+
+static void update_sub_links(struct client_sub *sub);
+static void unlink_sub(struct client_sub *sub);
+static struct client_sub *find_sub(struct client *client, struct device *dev);
+
+/* number of clients subscribed to each event mask bit */
+static int evmask_count[NUM_EVMASK_BITS];
+static unsigned int evmask_any;		/* bits with at least one subscriber */
 
 /* add a client to the list
  * cdata points to the socket fd for new-protocol clients, or the
@@ -48,7 +100,7 @@ struct client *add_client(int type, void *cdata)
 		return 0;
 	}
 
-	if(!(client = calloc(1, sizeof *client))) {
+	if(!(client = alloc_client())) {
 		return 0;
 	}
 
@@ -60,60 +112,216 @@ struct client *add_client(int type, void *cdata)
 		client->win = *(Window*)cdata;
 #endif
 	}
+	if(index_client(client) == -1) {
+		free_client(client);
+		return 0;
+	}
+	client->defsub.client = client;
+
 	/* default to protocol version 0 until the client changes it */
 	client->proto = 0;
 	/* evmask for proto-v0 clients is just input events */
-	client->evmask = EVMASK_MOTION | EVMASK_BUTTON;
+	set_client_evmask(client, EVMASK_MOTION | EVMASK_BUTTON);
 
 	client->sens = 1.0f;
 	client->dev = 0; /* default/first device */
 
-	if(!client_list && cfg.led == LED_AUTO) {
+	if(!num_clients++ && cfg.led == LED_AUTO) {
 		/* on first client, turn the led on */
 		set_devices_led(1);
 	}
+	client->prev = 0;
 	client->next = client_list;
+	if(client_list) client_list->prev = client;
 	client_list = client;
 
+	fanout_add_client(client);
 	return client;
 }
 
+/* Drops all the client state, and makes it invisible to lookups and
+ * iteration. The record itself is released by reap_clients.
+ */
 void remove_client(struct client *client)
 {
-	struct client *iter = client_list;
-	if(!iter) return;
+	if(!client || client->zombie) return;
+
+	metric_inc(MET_CLIENTS_CLOSED);
+	fanout_remove_client(client);
+	unindex_client(client);
+
+	if(verbose && client->deliv_mode == DELIV_RATELIMIT) {
+		logmsg(LOG_INFO, "client %s: %lu motion events merged by rate limiting\n",
+				get_client_name(client), client->cold->deliv.saved);
+	}
+	if(verbose && (client->cold->slow_count | client->outq.overwritten | client->outq.dropped)) {
+		logmsg(LOG_INFO, "client %s: fell behind %lu times, %lu motion events overwritten, %lu events dropped\n",
+				get_client_name(client), client->cold->slow_count,
+				client->outq.overwritten, client->outq.dropped);
+	}
+	if(client == active_client) {
+		set_active_client(client, 0, 0);
+	}
+	shm_ring_detach(client);
+	outq_destroy(&client->outq);
+	free(client->cold->frame.buf);
+	client->cold->frame.buf = 0;
+	set_client_evmask(client, 0);	/* drop subscriptions */
+	client_unsubscribe_dev(client, 0);
+
+	free(client->cold->name);
+	client->cold->name = 0;
+	free(client->cold->strbuf.buf);
+	client->cold->strbuf.buf = 0;
+
+	client->zombie = 1;
+	client->znext = zombies;
+	zombies = client;
+
+	if(!--num_clients && cfg.led == LED_AUTO) {
+		set_devices_led(0); /* no more clients, turn off led */
+	}
+}
 
-	if(iter == client) {
-		client_list = iter->next;
-		free_client(iter);
-		iter = client_list;
-		if(!iter) {
-			if(cfg.led == LED_AUTO) {
-				set_devices_led(0); /* no more clients, turn off led */
+void reap_clients(void)
+{
+	struct client *client;
+
+	while(zombies) {
+		client = zombies;
+		zombies = client->znext;
+
+		if(client->prev) {
+			client->prev->next = client->next;
+		} else {
+			client_list = client->next;
+		}
+		if(client->next) {
+			client->next->prev = client->prev;
+		}
+		free_client(client);
+	}
+}
+
+static struct client *alloc_client(void)
+{
+	int i;
+	struct client *client;
+	struct client_cold *cold;
+	struct client_slab *slab;
+
+	if(!free_clients) {
+		if(!(slab = malloc(sizeof *slab))) {
+			return 0;
+		}
+		slab->next = slabs;
+		slabs = slab;
+
+		for(i=0; i<CLIENT_SLAB_SIZE; i++) {
+			slab->clients[i].cold = slab->cold + i;
+			slab->clients[i].next = free_clients;
+			free_clients = slab->clients + i;
+		}
+	}
+
+	client = free_clients;
+	free_clients = client->next;
+
+	cold = client->cold;
+	memset(client, 0, sizeof *client);
+	memset(cold, 0, sizeof *cold);
+	client->cold = cold;
+	return client;
+}
+
+static void free_client(struct client *client)
+{
+	client->next = free_clients;
+	free_clients = client;
+}
+
+static int index_client(struct client *client)
+{
+	int newsz;
+	struct client **tmp;
+#ifdef USE_X11
+	unsigned int bucket;
+#endif
+
+	if(client->type == CLIENT_UNIX) {
+		if(client->sock < 0) return -1;
+
+		if(client->sock >= sock_index_size) {
+			newsz = sock_index_size ? sock_index_size * 2 : 64;
+			while(newsz <= client->sock) newsz *= 2;
+
+			if(!(tmp = realloc(sock_index, newsz * sizeof *sock_index))) {
+				return -1;
 			}
-			return;
+			memset(tmp + sock_index_size, 0, (newsz - sock_index_size) * sizeof *tmp);
+			sock_index = tmp;
+			sock_index_size = newsz;
 		}
+		sock_index[client->sock] = client;
+#ifdef USE_X11
+	} else {
+		bucket = WIN_HASH(client->win);
+		client->wnext = win_hash[bucket];
+		win_hash[bucket] = client;
+#endif
 	}
+	return 0;
+}
 
-	while(iter->next) {
-		if(iter->next == client) {
-			struct client *tmp = iter->next;
-			iter->next = tmp->next;
-			free_client(tmp);
-		} else {
-			iter = iter->next;
+static void unindex_client(struct client *client)
+{
+#ifdef USE_X11
+	struct client dummy, *iter;
+	unsigned int bucket;
+#endif
+
+	if(client->type == CLIENT_UNIX) {
+		if(sock_index[client->sock] == client) {
+			sock_index[client->sock] = 0;
 		}
+#ifdef USE_X11
+	} else {
+		bucket = WIN_HASH(client->win);
+		dummy.wnext = win_hash[bucket];
+		iter = &dummy;
+		while(iter->wnext) {
+			if(iter->wnext == client) {
+				iter->wnext = client->wnext;
+				break;
+			}
+			iter = iter->wnext;
+		}
+		win_hash[bucket] = dummy.wnext;
+#endif
 	}
 }
 
-void free_client(struct client *client)
+struct client *find_client_socket(int s)
 {
-	if(client) {
-		free(client->name);
-		free(client->strbuf.buf);
-		free(client);
+	if(s < 0 || s >= sock_index_size) {
+		return 0;
+	}
+	return sock_index[s];
+}
+
+#ifdef USE_X11
+struct client *find_client_window(Window win)
+{
+	struct client *c = win_hash[WIN_HASH(win)];
+	while(c) {
+		if(c->win == win) {
+			return c;
+		}
+		c = c->wnext;
 	}
+	return 0;
 }
+#endif
 
 int get_client_type(struct client *client)
 {
@@ -125,6 +333,11 @@ int get_client_socket(struct client *client)
 	return client->sock;
 }
 
+const char *get_client_name(struct client *client)
+{
+	return client->cold->name ? client->cold->name : "<unnamed>";
+}
+
 #ifdef USE_X11
 Window get_client_window(struct client *client)
 {
@@ -132,9 +345,105 @@ Window get_client_window(struct client *client)
 }
 #endif
 
+void set_client_evmask(struct client *client, unsigned int mask)
+{
+	int i;
+	unsigned int bit, changed = client->evmask ^ mask;
+
+	if(!changed) return;
+
+	fanout_lock(client);
+
+	for(i=0; i<NUM_EVMASK_BITS; i++) {
+		bit = 1 << i;
+		if(changed & bit) {
+			if(mask & bit) {
+				if(evmask_count[i]++ == 0) {
+					evmask_any |= bit;
+				}
+			} else {
+				if(--evmask_count[i] == 0) {
+					evmask_any &= ~bit;
+				}
+			}
+		}
+	}
+	client->evmask = mask;
+
+	/* relink all device subscriptions according to the new event mask */
+	if(client->subs) {
+		struct client_sub *sub = client->subs;
+		while(sub) {
+			update_sub_links(sub);
+			sub = sub->cnext;
+		}
+	} else {
+		update_sub_links(&client->defsub);
+	}
+	fanout_unlock(client);
+}
+
+int evmask_subscribed(unsigned int mask)
+{
+	return (evmask_any & mask) != 0;
+}
+
+int set_active_client(struct client *client, int active, unsigned int flags)
+{
+	if(active) {
+		if(active_client && active_client != client && (active_flags & ACTIVE_EXCLUSIVE)) {
+			return -1;
+		}
+	} else {
+		if(client != active_client) {
+			return 0;	/* wasn't active, nothing to release */
+		}
+		client = 0;
+		flags = 0;
+	}
+
+	/* fan-out workers check the active client for every motion event */
+	fanout_sync();
+	active_client = client;
+	active_flags = flags;
+
+	if(verbose) {
+		if(client) {
+			logmsg(LOG_INFO, "active client: %s%s\n", get_client_name(client),
+					flags & ACTIVE_EXCLUSIVE ? " (exclusive)" : "");
+		} else {
+			logmsg(LOG_INFO, "active client released\n");
+		}
+	}
+	return 0;
+}
+
+struct client *get_active_client(void)
+{
+	return active_client;
+}
+
+unsigned int get_active_flags(void)
+{
+	return active_flags;
+}
+
+int client_wants_motion(struct client *client)
+{
+	if(client == active_client) {
+		return 1;
+	}
+	if(active_client && (active_flags & ACTIVE_EXCLUSIVE)) {
+		return 0;
+	}
+	return !(client->evmask & EVMASK_ACTIVE_ONLY);
+}
+
 void set_client_sensitivity(struct client *client, float sens)
 {
+	fanout_lock(client);
 	client->sens = sens;
+	fanout_unlock(client);
 }
 
 float get_client_sensitivity(struct client *client)
@@ -147,21 +456,227 @@ void set_client_device(struct client *client, struct device *dev)
 	client->dev = dev;
 }
 
+/* device queries refer to the selected device if any, otherwise to the first
+ * subscribed device, or the first device if there are no subscriptions.
+ */
 struct device *get_client_device(struct client *client)
 {
-	return client->dev ? client->dev : get_devices();
+	if(client->dev) {
+		return client->dev;
+	}
+	return client->subs ? client->subs->dev : get_devices();
 }
 
-struct client *first_client(void)
+static unsigned int sub_class_evmask(int cls)
 {
-	client_iter = client_list;
-	return client_iter;
+	return cls == SUB_MOTION ? EVMASK_MOTION : EVMASK_BUTTON;
 }
 
-struct client *next_client(void)
+static struct client_sub **sub_list(struct client_sub *sub, int cls)
 {
-	if(client_iter) {
-		client_iter = client_iter->next;
+	return sub->dev ? sub->dev->subs + cls : default_subs + cls;
+}
+
+/* link or unlink a subscription to/from the lists of each event class,
+ * depending on the event mask.
+ */
+static void link_sub(struct client_sub *sub, unsigned int evmask)
+{
+	int i;
+	unsigned int bit;
+	struct client_sub **head;
+
+	for(i=0; i<NUM_SUB_CLASSES; i++) {
+		bit = 1 << i;
+		head = sub_list(sub, i);
+
+		if(evmask & sub_class_evmask(i)) {
+			if(!(sub->linked & bit)) {
+				sub->prev[i] = 0;
+				sub->next[i] = *head;
+				if(*head) (*head)->prev[i] = sub;
+				*head = sub;
+				sub->linked |= bit;
+			}
+		} else {
+			if(sub->linked & bit) {
+				if(sub->prev[i]) {
+					sub->prev[i]->next[i] = sub->next[i];
+				} else {
+					*head = sub->next[i];
+				}
+				if(sub->next[i]) {
+					sub->next[i]->prev[i] = sub->prev[i];
+				}
+				sub->linked &= ~bit;
+			}
+		}
+	}
+}
+
+static void update_sub_links(struct client_sub *sub)
+{
+	link_sub(sub, sub->client->evmask);
+}
+
+static void unlink_sub(struct client_sub *sub)
+{
+	link_sub(sub, 0);
+}
+
+static struct client_sub *find_sub(struct client *client, struct device *dev)
+{
+	struct client_sub *sub = client->subs;
+	while(sub) {
+		if(sub->dev == dev) {
+			return sub;
+		}
+		sub = sub->cnext;
 	}
-	return client_iter;
+	return 0;
+}
+
+static int add_sub(struct client *client, struct device *dev)
+{
+	struct client_sub *sub;
+
+	if(find_sub(client, dev)) {
+		return 0;
+	}
+	if(!(sub = calloc(1, sizeof *sub))) {
+		return -1;
+	}
+	sub->client = client;
+	sub->dev = dev;
+
+	if(!client->subs) {
+		unlink_sub(&client->defsub);	/* no longer following the default device */
+	}
+	fanout_lock(client);
+	sub->cnext = client->subs;
+	client->subs = sub;
+	fanout_unlock(client);
+
+	update_sub_links(sub);
+	return 0;
+}
+
+static void remove_sub(struct client *client, struct device *dev)
+{
+	struct client_sub dummy, *iter, *sub;
+
+	fanout_lock(client);
+	dummy.cnext = client->subs;
+	iter = &dummy;
+	while(iter->cnext) {
+		if(iter->cnext->dev == dev) {
+			sub = iter->cnext;
+			iter->cnext = sub->cnext;
+			unlink_sub(sub);
+			free(sub);
+			break;
+		}
+		iter = iter->cnext;
+	}
+	client->subs = dummy.cnext;
+	fanout_unlock(client);
+
+	if(!client->subs) {
+		update_sub_links(&client->defsub);	/* back to the default device */
+	}
+}
+
+int client_subscribe_dev(struct client *client, struct device *dev)
+{
+	if(dev) {
+		return add_sub(client, dev);
+	}
+
+	client->sub_all = 1;
+	dev = get_devices();
+	while(dev) {
+		if(add_sub(client, dev) == -1) {
+			return -1;
+		}
+		dev = dev->next;
+	}
+	return 0;
+}
+
+int client_unsubscribe_dev(struct client *client, struct device *dev)
+{
+	if(dev) {
+		if(!find_sub(client, dev)) {
+			return -1;
+		}
+		remove_sub(client, dev);
+		return 0;
+	}
+
+	client->sub_all = 0;
+	while(client->subs) {
+		remove_sub(client, client->subs->dev);
+	}
+	return 0;
+}
+
+int client_subscribed_dev(struct client *client, struct device *dev)
+{
+	return find_sub(client, dev) != 0;
+}
+
+struct client_sub *get_dev_subscribers(struct device *dev, int cls)
+{
+	return dev->subs[cls];
+}
+
+struct client_sub *get_default_subscribers(int cls)
+{
+	return default_subs[cls];
+}
+
+void clients_device_added(struct device *dev)
+{
+	struct client *c = first_client();
+	while(c) {
+		if(c->sub_all) {
+			add_sub(c, dev);
+		}
+		c = next_client(c);
+	}
+}
+
+void clients_device_removed(struct device *dev)
+{
+	struct client *c = first_client();
+
+	/* make sure no fan-out worker still refers to this device */
+	fanout_sync();
+
+	while(c) {
+		if(c->dev == dev) {
+			c->dev = 0;
+		}
+		if(find_sub(c, dev)) {
+			remove_sub(c, dev);
+		}
+		c = next_client(c);
+	}
+}
+
+struct client *first_client(void)
+{
+	struct client *c = client_list;
+	while(c && c->zombie) {
+		c = c->next;
+	}
+	return c;
+}
+
+struct client *next_client(struct client *c)
+{
+	do {
+		c = c->next;
+	} while(c && c->zombie);
+	return c;
 }
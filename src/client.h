@@ -20,12 +20,16 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define CLIENT_H_
 
 #include "config.h"
+#include <sys/types.h>
 
 #ifdef USE_X11
 #include <X11/Xlib.h>
 #endif
 
 #include "proto.h"
+#include "deliver.h"
+#include "dev.h"
+#include "outq.h"
 
 /* client types */
 enum {
@@ -40,38 +44,142 @@ enum {
 	EVMASK_DEV			= 0x04,
 	EVMASK_CFG			= 0x08,
 	EVMASK_RAWAXIS		= 0x10,
-	EVMASK_RAWBUTTON	= 0x20
+	EVMASK_RAWBUTTON	= 0x20,
+	EVMASK_ACTIVE_ONLY	= 0x40,	/* motion only while this client is active */
+	EVMASK_RAWFRAME		= 0x80	/* whole raw axis frames (UEV_RAWFRAME) */
 };
+#define NUM_EVMASK_BITS	8
 
-struct device;
+/* REQ_SET_ACTIVE flags */
+enum {
+	ACTIVE_EXCLUSIVE	= 0x01	/* motion goes only to the active client */
+};
 
-struct client {
-	int type;
+struct device;
+struct client;
+
+/* Subscription of a client to the events of a device. Each subscription is
+ * linked into the device's subscriber list of every event class the client
+ * has selected in its event mask.
+ */
+struct client_sub {
+	struct client *client;
+	struct device *dev;		/* null for the default device subscription */
+	unsigned int linked;	/* bitmask of the SUB_* lists we're linked into */
+	struct client_sub *next[NUM_SUB_CLASSES], *prev[NUM_SUB_CLASSES];
+	struct client_sub *cnext;	/* next subscription of the same client */
+};
 
-	int sock;	/* UNIX domain socket */
-	int proto;	/* protocol version */
-#ifdef USE_X11
-	Window win;	/* X11 client window */
-#endif
+#define REQBUF_SIZE		1024
+
+/* protocol v2 frame under construction (see struct frame_hdr in proto.h) */
+struct uframe {
+	char *buf;
+	int size, len;			/* allocated size and bytes used, including the header */
+	int count;				/* number of records */
+	int motion_pos;			/* offset of the last record if it's motion, 0 otherwise */
+	uint32_t seq;			/* sequence number of the next record */
+	unsigned long lost;		/* records lost since the last REC_DROP */
+	uint32_t lost_seq;		/* sequence number of the last lost record */
+};
 
-	float sens;	/* sensitivity */
-	struct device *dev;
+struct client_filter {
+	unsigned int axis_mask;
+	uint32_t bn_mask[2];
+	int min_delta;
+	int thres[6];
+	int last[6];			/* last motion values passed to the client */
+};
 
+/* Client state kept out of line: everything which isn't read for every client
+ * during event fan-out, including the state of optional features, which is
+ * only touched for the clients using them.
+ */
+struct client_cold {
 	char *name;				/* client name (not unique) */
-	unsigned int evmask;	/* event selection mask */
 
-	char reqbuf[64];
+	/* protocol v2 frame being assembled, queued at the next flush */
+	struct uframe frame;
+	/* motion delivery state, for delivery modes other than DELIV_DEFAULT */
+	struct deliv_state deliv;
+	/* server side event filter (REQ_SET_FILTER), if filter_on is set */
+	struct client_filter filter;
+
+	/* request bytes received, possibly several requests and a partial one */
+	char reqbuf[REQBUF_SIZE];
 	int reqbytes;
+	int in_requests;		/* processing requests, hold back immediate flushes */
+	int req_held;			/* requests held back until the client reads its output */
 
 	/* protocol buffer for handling reception of strings in multiple packets */
 	struct reqresp_strbuf strbuf;
+	/* long string request waiting for its payload, and payload bytes missing */
+	struct reqresp strreq;
+	int strpend;
+	int strmode;			/* form of strings sent to the client (STRMODE_*) */
 
-	struct client *next;
+	unsigned long slow_count;	/* number of times the client fell behind */
+
+	uid_t uid;				/* user id of UNIX clients */
+	int ring_evfd;			/* shared ring wakeup eventfd, if c->ring is set */
+};
+
+/* The fields read for every client during fan-out come first: the event
+ * selection fields in the first cache line, then the default subscription
+ * links which dispatch walks, and the output queue (see bench/bench_layout).
+ * The rest of the per-client state follows, or is kept out of line in struct
+ * client_cold.
+ */
+struct client {
+	int type;
+	int sock;	/* UNIX domain socket */
+	unsigned int evmask;	/* event selection mask */
+	float sens;	/* sensitivity */
+	int deliv_mode;			/* motion delivery mode (DELIV_*) */
+	int slow;				/* falling behind, non-essential events are skipped */
+	int dead;				/* to be disconnected at the end of the loop iteration */
+	int zombie;				/* removed, waiting for reap_clients */
+	int shard;				/* fan-out worker serving this client, or -1 */
+	int proto;	/* protocol version */
+	int evenc;				/* event encoding (EVENC_*) */
+	int ring;				/* events go to the shared memory ring instead */
+	int filter_on;			/* server side event filter in cold->filter */
+	unsigned long num_events;	/* events queued, for the metrics */
+
+	struct client_sub defsub;
+	struct client_cold *cold;
+
+	/* output waiting for the client to catch up (UNIX clients only) */
+	struct outq outq;
+
+	/* device subscriptions. Clients which haven't subscribed to any devices,
+	 * get events from the first device through the default subscription.
+	 */
+	struct client_sub *subs;
+	struct device *dev;
+	int sub_all;			/* subscribe to all present and future devices */
+
+	struct client *next, *prev;
+	struct client *snext, *sprev;
+	struct client *znext;
+#ifdef USE_X11
+	Window win;	/* X11 client window */
+	struct client *wnext;	/* window hash chain */
+#endif
 };
 
 struct client *add_client(int type, void *cdata);
+/* removed clients are skipped by iteration and lookups, but their records
+ * remain valid until the next call to reap_clients.
+ */
 void remove_client(struct client *client);
-void free_client(struct client *client);
+void reap_clients(void);
+
+struct client *find_client_socket(int s);
+const char *get_client_name(struct client *client);
+#ifdef USE_X11
+struct client *find_client_window(Window win);
+#endif
 
 int get_client_type(struct client *client);
 int get_client_socket(struct client *client);
@@ -79,15 +187,52 @@ int get_client_socket(struct client *client);
 Window get_client_window(struct client *client);
 #endif
 
+/* changes the event mask, keeping track of the number of subscribers to
+ * each event class
+ */
+void set_client_evmask(struct client *client, unsigned int mask);
+/* non-zero if any client is subscribed to any of the events in mask */
+int evmask_subscribed(unsigned int mask);
+
 void set_client_sensitivity(struct client *client, float sens);
 float get_client_sensitivity(struct client *client);
 
 void set_client_device(struct client *client, struct device *dev);
 struct device *get_client_device(struct client *client);
 
-/* these two can be used to iterate over all clients */
+/* Claim (active non-zero) or release the active client status. Only one
+ * client is active at a time; a new claim takes over from the previous active
+ * client, unless that one holds an exclusive claim, in which case it fails.
+ * Returns 0 on success, -1 on failure.
+ */
+int set_active_client(struct client *client, int active, unsigned int flags);
+struct client *get_active_client(void);
+unsigned int get_active_flags(void);
+/* non-zero if motion events should be delivered to this client, according to
+ * the active client arbitration and its EVMASK_ACTIVE_ONLY flag.
+ */
+int client_wants_motion(struct client *client);
+
+/* dev null subscribes to all present and future devices */
+int client_subscribe_dev(struct client *client, struct device *dev);
+/* dev null removes all subscriptions */
+int client_unsubscribe_dev(struct client *client, struct device *dev);
+/* non-zero if the client has an explicit subscription to dev */
+int client_subscribed_dev(struct client *client, struct device *dev);
+
+/* lists of subscriptions for an event class (SUB_*), linked by next[cls] */
+struct client_sub *get_dev_subscribers(struct device *dev, int cls);
+struct client_sub *get_default_subscribers(int cls);
+
+/* called by the device code to keep subscriptions up to date */
+void clients_device_added(struct device *dev);
+void clients_device_removed(struct device *dev);
+
+/* these two can be used to iterate over all clients. Iteration can be nested,
+ * and it's safe to remove clients in the process.
+ */
 struct client *first_client(void);
-struct client *next_client(void);
+struct client *next_client(struct client *c);
 
 
 #endif	/* CLIENT_H_ */
@@ -0,0 +1,23 @@
+#ifndef CONFIG_H_
+#define CONFIG_H_
+
+#define USE_X11
+
+#define USE_NETLINK
+
+#define USE_THREADS
+
+#define VERSION "2ff101f"
+
+#define HAVE_ALLOCA_H
+#define HAVE_MALLOC_H
+#define HAVE_STDINT_H
+#define HAVE_INTTYPES_H
+#define HAVE_UINPUT_H
+#define HAVE_VSNPRINTF
+#define HAVE_MEMFD_CREATE
+#define HAVE_EVENTFD
+
+#define CFGDIR "/etc"
+
+#endif	/* CONFIG_H_ */
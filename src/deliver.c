@@ -0,0 +1,518 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/sockios.h>
+#include <sys/timerfd.h>
+#define USE_TIMERFD
+#endif
+#include "deliver.h"
+#include "client.h"
+#include "proto_unix.h"
+#include "spnavd.h"
+
+/* how often to check if a client with undelivered motion is ready to receive
+ * it, when we have no way of being notified about it.
+ */
+#define POLL_USEC	5000
+
+#define MIN_RATE	1.0f
+#define MAX_RATE	1000.0f
+
+static void update_timer(void);
+static void arm_timer(long long due);
+static void integrate(struct deliv_state *ds, long long now);
+static int accum_pending(struct deliv_state *ds);
+static int client_ready(struct client *c);
+static void send_accum(struct client *c, long long now);
+static long long next_tick(struct deliv_state *ds, long long now);
+static void resample(struct deliv_state *ds, long long t, int *res);
+static void send_tick(struct client *c, long long now);
+static void merge_motion(struct deliv_state *ds);
+static void send_merged(struct client *c, long long now);
+
+static int timer_fd = -1;
+static long long timer_due;
+
+
+int init_deliver(void)
+{
+#ifdef USE_TIMERFD
+	if(timer_fd >= 0) return 0;
+
+	if((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1) {
+		logmsg(LOG_WARNING, "failed to create delivery timer: %s\n", strerror(errno));
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+void close_deliver(void)
+{
+	if(timer_fd >= 0) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+}
+
+int get_deliver_fd(void)
+{
+	return timer_fd;
+}
+
+int set_delivery_mode(struct client *c, int mode, const int32_t *params)
+{
+	float rate;
+	long long now;
+
+	if(mode < 0 || mode >= MAX_DELIV) {
+		return -1;
+	}
+	if(mode == DELIV_RESAMPLE) {
+		rate = *(float*)params;
+		if(!(rate >= MIN_RATE && rate <= MAX_RATE)) {
+			return -1;
+		}
+	}
+	if(mode == DELIV_RATELIMIT) {
+		if(params[0] <= 0 || params[1] < 0 || params[1] >= MAX_MERGE) {
+			return -1;
+		}
+	}
+
+	now = get_usec();
+	memset(&c->cold->deliv, 0, sizeof c->cold->deliv);
+	c->cold->deliv.last_step = c->cold->deliv.last_send = now;
+
+	if(mode == DELIV_RESAMPLE) {
+		c->cold->deliv.period = 1000000.0 / rate;
+		c->cold->deliv.phase = params[1];
+		c->cold->deliv.tick = next_tick(&c->cold->deliv, now);
+	}
+	if(mode == DELIV_RATELIMIT) {
+		c->cold->deliv.interval = params[0];
+		c->cold->deliv.policy = params[1];
+	}
+
+	c->deliv_mode = mode;
+	return 0;
+}
+
+void deliver_motion(struct client *c, spnav_event *ev)
+{
+	int i;
+	long long now;
+	float sens;
+	struct deliv_state *ds = &c->cold->deliv;
+	struct deliv_frame *frm;
+
+	now = get_usec();
+
+	switch(c->deliv_mode) {
+	case DELIV_ACCUM:
+		/* integrate the previous motion values up to this point, and hold the
+		 * new ones until the next motion event or delivery
+		 */
+		integrate(ds, now);
+		break;
+
+	default:
+		break;
+	}
+
+	sens = get_client_sensitivity(c);
+	for(i=0; i<6; i++) {
+		ds->val[i] = (int)((float)ev->motion.data[i] * sens);
+	}
+
+	switch(c->deliv_mode) {
+	case DELIV_ACCUM:
+		if(client_ready(c)) {
+			send_accum(c, now);
+		}
+		break;
+
+	case DELIV_RESAMPLE:
+		ds->hist_head = (ds->hist_head + 1) % RESAMPLE_HIST;
+		frm = ds->hist + ds->hist_head;
+		frm->t = now;
+		memcpy(frm->val, ds->val, sizeof frm->val);
+		if(ds->hist_count < RESAMPLE_HIST) {
+			ds->hist_count++;
+		}
+
+		if(!ds->active) {
+			/* start ticking again from the next tick after this frame */
+			ds->active = 1;
+			ds->tick = next_tick(ds, now);
+			arm_timer(ds->tick);
+		}
+		break;
+
+	case DELIV_RATELIMIT:
+		if(!ds->active) {
+			/* no window open, send right away and start a new one */
+			memcpy(ds->merged, ds->val, sizeof ds->merged);
+			send_merged(c, now);
+			ds->active = 1;
+			ds->tick = now + ds->interval;
+			arm_timer(ds->tick);
+		} else {
+			if(ds->pending) {
+				ds->saved++;
+				merge_motion(ds);
+			} else {
+				memcpy(ds->merged, ds->val, sizeof ds->merged);
+				ds->pending = 1;
+			}
+		}
+		break;
+
+	default:
+		break;
+	}
+}
+
+void deliver_flush(struct client *c)
+{
+	if(c->deliv_mode == DELIV_RATELIMIT && c->cold->deliv.pending) {
+		send_merged(c, get_usec());
+	}
+}
+
+long long deliver_timeout(void)
+{
+	struct client *c;
+	long long now, dt, res = -1;
+
+	now = get_usec();
+
+	c = first_client();
+	while(c) {
+		dt = -1;
+		switch(c->deliv_mode) {
+		case DELIV_ACCUM:
+			if(accum_pending(&c->cold->deliv)) {
+				dt = POLL_USEC;
+			}
+			break;
+
+		case DELIV_RESAMPLE:
+		case DELIV_RATELIMIT:
+			if(timer_fd == -1 && c->cold->deliv.active) {
+				dt = c->cold->deliv.tick > now ? c->cold->deliv.tick - now : 0;
+			}
+			break;
+
+		default:
+			break;
+		}
+
+		if(dt >= 0 && (res < 0 || dt < res)) {
+			res = dt;
+		}
+		c = next_client(c);
+	}
+	return res;
+}
+
+void deliver_pending(void)
+{
+	struct client *c;
+	long long now = get_usec();
+#ifdef USE_TIMERFD
+	uint64_t expirations;
+
+	if(timer_fd >= 0) {
+		while(read(timer_fd, &expirations, sizeof expirations) == -1 && errno == EINTR);
+	}
+#endif
+
+	c = first_client();
+	while(c) {
+		switch(c->deliv_mode) {
+		case DELIV_ACCUM:
+			if(accum_pending(&c->cold->deliv) && client_ready(c)) {
+				integrate(&c->cold->deliv, now);
+				send_accum(c, now);
+			}
+			break;
+
+		case DELIV_RESAMPLE:
+			if(c->cold->deliv.active && c->cold->deliv.tick <= now) {
+				send_tick(c, now);
+			}
+			break;
+
+		case DELIV_RATELIMIT:
+			if(c->cold->deliv.active && c->cold->deliv.tick <= now) {
+				/* end of window, send any merged motion and keep the window open
+				 * for another interval, otherwise close it.
+				 */
+				if(c->cold->deliv.pending) {
+					send_merged(c, now);
+					c->cold->deliv.tick = now + c->cold->deliv.interval;
+				} else {
+					c->cold->deliv.active = 0;
+				}
+			}
+			break;
+
+		default:
+			break;
+		}
+		c = next_client(c);
+	}
+
+	update_timer();
+}
+
+/* arm the timer for the earliest tick of any ticking client */
+static void update_timer(void)
+{
+#ifdef USE_TIMERFD
+	struct client *c;
+	long long due = 0;
+	struct itimerspec its;
+
+	if(timer_fd == -1) return;
+
+	c = first_client();
+	while(c) {
+		if((c->deliv_mode == DELIV_RESAMPLE || c->deliv_mode == DELIV_RATELIMIT) &&
+				c->cold->deliv.active) {
+			if(!due || c->cold->deliv.tick < due) {
+				due = c->cold->deliv.tick;
+			}
+		}
+		c = next_client(c);
+	}
+
+	if(due == timer_due) return;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = due / 1000000;
+	its.it_value.tv_nsec = (due % 1000000) * 1000;
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, 0);	/* zero disarms */
+	timer_due = due;
+#endif
+}
+
+/* make sure the timer expires no later than due. Doesn't iterate over the
+ * client list, so it's safe to call while dispatching events.
+ */
+static void arm_timer(long long due)
+{
+#ifdef USE_TIMERFD
+	struct itimerspec its;
+
+	if(timer_fd == -1 || (timer_due && timer_due <= due)) return;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = due / 1000000;
+	its.it_value.tv_nsec = (due % 1000000) * 1000;
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, 0);
+	timer_due = due;
+#endif
+}
+
+static void integrate(struct deliv_state *ds, long long now)
+{
+	int i;
+	long long dt = now - ds->last_step;
+
+	for(i=0; i<6; i++) {
+		ds->acc[i] += ds->val[i] * dt;
+	}
+	ds->last_step = now;
+}
+
+static int accum_pending(struct deliv_state *ds)
+{
+	int i;
+	for(i=0; i<6; i++) {
+		if(ds->val[i] || ds->acc[i] / 1000) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* a client is ready to receive the next delivery when it has consumed
+ * everything we've sent it so far. If we can't find out, every motion event
+ * results in a delivery.
+ */
+static int client_ready(struct client *c)
+{
+	if(uclient_pending(c)) {
+		return 0;
+	}
+#ifdef SIOCOUTQ
+	int outq;
+	if(ioctl(get_client_socket(c), SIOCOUTQ, &outq) != -1) {
+		return outq == 0;
+	}
+#endif
+	return 1;
+}
+
+/* sends the accumulated displacement in value-milliseconds. Any sub-unit
+ * remainder is carried over to the next delivery, so that no motion is lost.
+ */
+static void send_accum(struct client *c, long long now)
+{
+	int i;
+	long long elapsed;
+	int32_t data[8] = {0};
+
+	data[0] = UEV_MOTION_ACCUM;
+	for(i=0; i<6; i++) {
+		data[i + 1] = (int32_t)(c->cold->deliv.acc[i] / 1000);
+		c->cold->deliv.acc[i] -= (long long)data[i + 1] * 1000;
+	}
+
+	elapsed = now - c->cold->deliv.last_send;
+	data[7] = elapsed > 0x7fffffff ? 0x7fffffff : (int32_t)elapsed;
+	c->cold->deliv.last_send = now;
+
+	send_uevmsg(c, data, now);
+}
+
+/* first tick strictly after now, aligned to the client phase */
+static long long next_tick(struct deliv_state *ds, long long now)
+{
+	long long t;
+	double n = floor((double)(now - ds->phase) / ds->period) + 1.0;
+
+	while((t = ds->phase + (long long)(n * ds->period + 0.5)) <= now) {
+		n += 1.0;
+	}
+	return t;
+}
+
+/* interpolate the motion frame history at time t. Since each device report
+ * holds until the next one, sampling past the newest frame returns it as is.
+ */
+static void resample(struct deliv_state *ds, long long t, int *res)
+{
+	int i, n, idx;
+	struct deliv_frame *f0, *f1;
+	float s;
+
+	f1 = ds->hist + ds->hist_head;
+	if(!ds->hist_count || t >= f1->t) {
+		memcpy(res, ds->val, 6 * sizeof *res);
+		return;
+	}
+
+	for(n=1; n<ds->hist_count; n++) {
+		idx = (ds->hist_head + RESAMPLE_HIST - n) % RESAMPLE_HIST;
+		f0 = ds->hist + idx;
+		if(f0->t <= t) {
+			s = (float)(t - f0->t) / (float)(f1->t - f0->t);
+			for(i=0; i<6; i++) {
+				res[i] = f0->val[i] + (int)((float)(f1->val[i] - f0->val[i]) * s);
+			}
+			return;
+		}
+		f1 = f0;
+	}
+	/* older than the whole history, use the oldest frame */
+	memcpy(res, f1->val, 6 * sizeof *res);
+}
+
+/* Sends the motion for the latest tick which is due. Motion is sampled one
+ * tick in the past, so that there's usually a device report on either side
+ * of the sample point to interpolate between. Missed ticks are skipped.
+ */
+static void send_tick(struct client *c, long long now)
+{
+	int i, nonzero = 0;
+	struct deliv_state *ds = &c->cold->deliv;
+	int32_t data[8] = {0};
+	long long t;
+
+	t = ds->tick;
+	while((ds->tick = next_tick(ds, t)) <= now) {
+		t = ds->tick;
+	}
+
+	data[0] = UEV_MOTION;
+	resample(ds, t - (long long)ds->period, data + 1);
+	for(i=0; i<6; i++) {
+		if(data[i + 1]) nonzero = 1;
+	}
+	data[7] = (int32_t)((t - ds->last_send) / 1000);
+	ds->last_send = t;
+
+	send_uevmotion(c, data, t);
+
+	/* stop ticking after sending a zero motion event, if the device is at rest */
+	if(!nonzero) {
+		for(i=0; i<6; i++) {
+			if(ds->val[i]) break;
+		}
+		if(i >= 6) ds->active = 0;
+	}
+}
+
+static void merge_motion(struct deliv_state *ds)
+{
+	int i;
+
+	switch(ds->policy) {
+	case MERGE_SUM:
+		for(i=0; i<6; i++) {
+			ds->merged[i] += ds->val[i];
+		}
+		break;
+
+	case MERGE_MAX:
+		for(i=0; i<6; i++) {
+			if(abs(ds->val[i]) > abs(ds->merged[i])) {
+				ds->merged[i] = ds->val[i];
+			}
+		}
+		break;
+
+	case MERGE_LATEST:
+	default:
+		memcpy(ds->merged, ds->val, sizeof ds->merged);
+	}
+}
+
+static void send_merged(struct client *c, long long now)
+{
+	struct deliv_state *ds = &c->cold->deliv;
+	int32_t data[8] = {0};
+
+	data[0] = UEV_MOTION;
+	memcpy(data + 1, ds->merged, sizeof ds->merged);
+	data[7] = (int32_t)((now - ds->last_send) / 1000);
+	ds->last_send = now;
+	ds->pending = 0;
+
+	send_uevmotion(c, data, now);
+}
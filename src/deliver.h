@@ -0,0 +1,101 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DELIVER_H_
+#define DELIVER_H_
+
+#include "config.h"
+#include "event.h"
+#include "proto.h"
+
+/* per-client motion delivery modes (must match SPNAV_DELIV_* in libspnav) */
+enum {
+	DELIV_DEFAULT,	/* send every motion event as soon as it's generated */
+	DELIV_ACCUM,	/* integrate motion, and send the displacement when the client is ready */
+	DELIV_RESAMPLE,	/* send one interpolated motion event per tick, at a fixed rate */
+	DELIV_RATELIMIT,	/* merge motion events closer than a minimum interval */
+
+	MAX_DELIV
+};
+
+/* motion merging policies for DELIV_RATELIMIT */
+enum {
+	MERGE_LATEST,	/* keep the most recent motion values */
+	MERGE_SUM,		/* add up the motion values */
+	MERGE_MAX,		/* keep the largest magnitude per axis */
+
+	MAX_MERGE
+};
+
+#define RESAMPLE_HIST	4
+
+struct client;
+
+struct deliv_frame {
+	long long t;
+	int val[6];
+};
+
+struct deliv_state {
+	int val[6];				/* current motion values, held until the next motion event */
+	long long last_send;	/* time of the last delivery (usec) */
+
+	/* DELIV_ACCUM */
+	long long acc[6];		/* integrated displacement since the last delivery (value * usec) */
+	long long last_step;	/* time of the last integration step (usec) */
+
+	/* DELIV_RESAMPLE */
+	double period;			/* tick period (usec) */
+	long long phase;		/* tick phase offset from the monotonic clock epoch (usec) */
+	long long tick;			/* time of the next tick, or end of the rate-limit window (usec) */
+	int active;				/* ticking, or rate-limit window open */
+	struct deliv_frame hist[RESAMPLE_HIST];	/* most recent motion frames */
+	int hist_head, hist_count;
+
+	/* DELIV_RATELIMIT */
+	long long interval;		/* minimum interval between motion events (usec) */
+	int policy;				/* merge policy (MERGE_*) */
+	int pending;			/* merged motion waiting for the end of the window */
+	int merged[6];
+	unsigned long saved;	/* number of motion events merged instead of sent */
+};
+
+int init_deliver(void);
+void close_deliver(void);
+/* file descriptor of the delivery timer, or -1 if we have to rely on the
+ * select timeout for waking up in time for deliveries
+ */
+int get_deliver_fd(void);
+
+/* params are the request data following the mode (see REQ_SET_DELIVERY) */
+int set_delivery_mode(struct client *c, int mode, const int32_t *params);
+
+/* called by the protocol code for every motion event destined to a client,
+ * which is not in the default delivery mode
+ */
+void deliver_motion(struct client *c, spnav_event *ev);
+/* sends any held back motion, to keep it in order with other events */
+void deliver_flush(struct client *c);
+
+/* returns the number of microseconds until the next pending delivery, or -1 if
+ * there are no pending deliveries which need a select timeout to wake us up
+ */
+long long deliver_timeout(void);
+/* sends any pending deliveries to clients which are ready to receive them */
+void deliver_pending(void);
+
+#endif	/* DELIVER_H_ */
@@ -29,6 +29,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "spnavd.h"
 #include "proto.h"
 #include "proto_unix.h"
+#include "client.h"
+#include "shm.h"
 
 #ifdef USE_X11
 #include "proto_x11.h"
@@ -147,6 +149,7 @@ void init_devices_serial(void)
 				return;
 			}
 			logmsg(LOG_INFO, "using device: %s\n", cfg.serial_dev);
+			clients_device_added(dev);
 
 			/* new serial device added, send device change event */
 			ev.dev.type = EVENT_DEV;
@@ -211,6 +214,8 @@ int init_devices_usb(void)
 					logmsg(LOG_INFO, "%s\n", buf);
 				}
 
+				clients_device_added(dev);
+
 				/* new USB device added, send device change event */
 				ev.dev.type = EVENT_DEV;
 				ev.dev.op = DEV_ADD;
@@ -250,6 +255,7 @@ static struct device *add_device(void)
 	memset(dev, 0, sizeof *dev);
 
 	dev->fd = -1;
+	dev->state_fd = -1;
 	dev->id = last_id++;
 	dev->next = dev_list;
 	dev_list = dev;
@@ -280,6 +286,8 @@ void remove_device(struct device *dev)
 	dev_list = dummy.next;
 
 	remove_dev_event(dev);
+	clients_device_removed(dev);
+	shm_devstate_destroy(dev);
 
 	if(dev->close) {
 		dev->close(dev);
@@ -309,6 +317,18 @@ struct device *dev_path_in_use(const char *dev_path)
 	return 0;
 }
 
+struct device *find_device(int id)
+{
+	struct device *iter = dev_list;
+	while(iter) {
+		if(iter->id == id) {
+			return iter;
+		}
+		iter = iter->next;
+	}
+	return 0;
+}
+
 int get_device_fd(struct device *dev)
 {
 	return dev ? dev->fd : -1;
@@ -20,33 +20,61 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <limits.h>
 #include "config.h"
+#include "proto.h"
 
 struct dev_input;
+struct client_sub;
+struct shm_devstate;
 
 #define MAX_DEV_NAME	256
 
+/* event classes with per-device client subscriber lists (see client.c) */
+enum {
+	SUB_MOTION,
+	SUB_BUTTON,
+
+	NUM_SUB_CLASSES
+};
+
+/* the fields used for every input event come first, names and paths last */
 struct device {
-	int id;
 	int fd;
+	int (*read)(struct device*, struct dev_input*);
 	void *data;
-	char name[MAX_DEV_NAME];
-	char path[PATH_MAX];
-	int type;
-	unsigned int usbid[2];	/* vendor:product for USB devices */
+	int id;
 	unsigned int flags;
 
 	int num_axes, num_buttons;
 	int bnbase;				/* button base (reported number of first button) */
 	int *minval, *maxval;	/* input value range (default: -500, 500) */
 	int *fuzz;				/* noise threshold */
+	int (*bnhack)(int bn);
 
-	void (*close)(struct device*);
-	int (*read)(struct device*, struct dev_input*);
-	void (*set_led)(struct device*, int);
+	/* clients subscribed to this device, for each event class */
+	struct client_sub *subs[NUM_SUB_CLASSES];
 
-	int (*bnhack)(int bn);
+	/* shared state page, created on the first REQ_DEV_STATE */
+	struct shm_devstate *state;
+	int state_fd;
+
+	unsigned long num_inputs;	/* inputs read, for the metrics */
+
+	/* raw axis values as of the current input frame, for EVMASK_RAWFRAME
+	 * events and the shared state page, both updated once per frame.
+	 */
+	int32_t rawframe[SHM_DEVSTATE_AXES];
+	int rawframe_pending;
 
 	struct device *next;
+
+	int type;
+	unsigned int usbid[2];	/* vendor:product for USB devices */
+
+	void (*close)(struct device*);
+	void (*set_led)(struct device*, int);
+
+	char name[MAX_DEV_NAME];
+	char path[PATH_MAX];
 };
 
 void init_devices(void);
@@ -65,5 +93,6 @@ void set_devices_led(int state);
 struct device *get_devices(void);
 
 struct device *dev_path_in_use(const char *dev_path);
+struct device *find_device(int id);
 
 #endif	/* SPNAV_DEV_H_ */
@@ -25,6 +25,8 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "proto_unix.h"
 #include "spnavd.h"
 #include "kbemu.h"
+#include "fanout.h"
+#include "shm.h"
 
 #ifdef USE_X11
 #include "proto_x11.h"
@@ -52,6 +54,7 @@ static struct dev_event *add_dev_event(struct device *dev);
 static struct dev_event *device_event_in_use(struct device *dev);
 static void handle_button_action(int act, int val);
 static void dispatch_event(struct dev_event *dev);
+static long long begin_event(void);
 static void send_event(spnav_event *ev, struct client *c);
 static unsigned int msec_dif(struct timeval tv1, struct timeval tv2);
 
@@ -142,6 +145,14 @@ static INLINE int map_axis(int devaxis)
 	return axis;
 }
 
+int dev_axis_mapping(int devaxis)
+{
+	if(devaxis < 0 || devaxis >= MAX_AXES) {
+		return -1;
+	}
+	return map_axis(devaxis);
+}
+
 /* process_input processes an device input event, and dispatches
  * spacenav events to the clients by calling dispatch_event.
  * relative inputs (INP_MOTION) are accumulated, and dispatched when
@@ -150,17 +161,34 @@ static INLINE int map_axis(int devaxis)
  */
 void process_input(struct device *dev, struct dev_input *inp)
 {
-	int sign, axis, abs_val;
+	int i, sign, axis, abs_val;
 	struct dev_event *dev_ev;
 	float sens_rot, sens_trans, axis_sens;
 	spnav_event ev;
 
 	switch(inp->type) {
 	case INP_MOTION:
-		ev.type = EVENT_RAWAXIS;
-		ev.axis.idx = inp->idx;
-		ev.axis.value = inp->val;
-		broadcast_event(&ev);
+		if(evmask_subscribed(EVMASK_RAWAXIS)) {
+			ev.type = EVENT_RAWAXIS;
+			ev.axis.idx = inp->idx;
+			ev.axis.value = inp->val;
+			broadcast_event(&ev);
+		}
+		if(inp->idx >= 0 && inp->idx < SHM_DEVSTATE_AXES) {
+			dev->rawframe[inp->idx] = inp->val;
+			dev->rawframe_pending = 1;
+		}
+
+		/* nobody wants motion events, don't bother computing them, and drop
+		 * any stale motion state, so that it doesn't get repeated.
+		 */
+		if(!evmask_subscribed(EVMASK_MOTION) && !dev->state) {
+			if((dev_ev = device_event_in_use(dev))) {
+				memset(dev_ev->event.motion.data, 0, 6 * sizeof(int));
+				dev_ev->pending = 0;
+			}
+			break;
+		}
 
 		abs_val = abs(inp->val);
 
@@ -200,10 +228,12 @@ void process_input(struct device *dev, struct dev_input *inp)
 		break;
 
 	case INP_BUTTON:
-		ev.type = EVENT_RAWBUTTON;
-		ev.button.press = inp->val;
-		ev.button.bnum = inp->idx;
-		broadcast_event(&ev);
+		if(evmask_subscribed(EVMASK_RAWBUTTON)) {
+			ev.type = EVENT_RAWBUTTON;
+			ev.button.press = inp->val;
+			ev.button.bnum = inp->idx;
+			broadcast_event(&ev);
+		}
 
 		/* check to see if the button has been bound to an action */
 		if(cfg.bnact[inp->idx] > 0) {
@@ -234,8 +264,12 @@ void process_input(struct device *dev, struct dev_input *inp)
 		}
 		inp->idx = cfg.map_button[inp->idx];
 
+		if(dev->state) {
+			shm_devstate_button(dev, inp->idx, inp->val, get_usec());
+		}
+
 		/* button events are not queued */
-		{
+		if(evmask_subscribed(EVMASK_BUTTON)) {
 			struct dev_event dev_button_event;
 			dev_button_event.dev = dev;
 			dev_button_event.event.type = EVENT_BUTTON;
@@ -254,11 +288,38 @@ void process_input(struct device *dev, struct dev_input *inp)
 		break;
 
 	case INP_FLUSH:
+		if(dev->rawframe_pending && evmask_subscribed(EVMASK_RAWFRAME)) {
+			ev.type = EVENT_RAWFRAME;
+			ev.rawframe.dev = dev->id;
+			ev.rawframe.num_axes = dev->num_axes < RAWFRAME_AXES ? dev->num_axes : RAWFRAME_AXES;
+			/* saturate, rather than wrap around, values which don't fit */
+			for(i=0; i<RAWFRAME_AXES; i++) {
+				if(dev->rawframe[i] > INT16_MAX) {
+					ev.rawframe.axes[i] = INT16_MAX;
+				} else if(dev->rawframe[i] < INT16_MIN) {
+					ev.rawframe.axes[i] = INT16_MIN;
+				} else {
+					ev.rawframe.axes[i] = dev->rawframe[i];
+				}
+			}
+			broadcast_event(&ev);
+		}
+		/* the whole frame in one state page update, so that readers never
+		 * see raw values from two different frames.
+		 */
+		if(dev->rawframe_pending && dev->state) {
+			shm_devstate_raw(dev, dev->rawframe, dev->num_axes, get_usec());
+		}
+		dev->rawframe_pending = 0;
+
 		dev_ev = device_event_in_use(dev);
 		if(dev_ev && dev_ev->pending) {
 			dispatch_event(dev_ev);
 			dev_ev->pending = 0;
 		}
+		if(cfg.client_flush == FLUSH_FRAME) {
+			flush_uevents();
+		}
 		break;
 
 	default:
@@ -299,6 +360,7 @@ static void handle_button_action(int act, int pressed)
 		dom_axis_mode = !dom_axis_mode;
 		break;
 	}
+	shm_cfg_update();
 }
 
 int in_deadzone(struct device *dev)
@@ -324,8 +386,9 @@ void repeat_last_event(struct device *dev)
 
 static void dispatch_event(struct dev_event *dev_ev)
 {
-	struct client *c, *client_iter;
-	struct device *client_dev;
+	int cls;
+	long long now;
+	struct client_sub *sub, *next;
 
 	if(dev_ev->event.type == EVENT_MOTION) {
 		struct timeval tv;
@@ -335,30 +398,81 @@ static void dispatch_event(struct dev_event *dev_ev)
 		dev_ev->timeval = tv;
 	}
 
-	client_iter = first_client();
-	while(client_iter) {
-		c = client_iter;
-		client_iter = next_client();
+	cls = dev_ev->event.type == EVENT_MOTION ? SUB_MOTION : SUB_BUTTON;
 
-		/* if the client has selected a single device to get input from, then
-		 * don't send the event if it originates from a different device
-		 */
-		client_dev = get_client_device(c);
-		if(!client_dev || client_dev == dev_ev->dev) {
-			send_event(&dev_ev->event, c);
+	now = begin_event();
+	if(cls == SUB_MOTION && dev_ev->dev->state) {
+		shm_devstate_motion(dev_ev->dev, dev_ev->event.motion.data, now);
+	}
+	fanout_publish(&dev_ev->event, dev_ev->dev, cls, now);
+	shm_ring_publish(&dev_ev->event, dev_ev->dev, now);
+
+	/* clients subscribed explicitly to this device */
+	sub = get_dev_subscribers(dev_ev->dev, cls);
+	while(sub) {
+		next = sub->next[cls];	/* send may drop the client */
+		if(!fanout_owns(sub->client)) {
+			send_event(&dev_ev->event, sub->client);
+		}
+		sub = next;
+	}
+
+	/* clients without explicit subscriptions get events from the first device */
+	if(dev_ev->dev == get_devices()) {
+		sub = get_default_subscribers(cls);
+		while(sub) {
+			next = sub->next[cls];
+			if(!fanout_owns(sub->client)) {
+				send_event(&dev_ev->event, sub->client);
+			}
+			sub = next;
 		}
 	}
 }
 
+unsigned int event_evmask(int evtype)
+{
+	switch(evtype) {
+	case EVENT_MOTION:
+		return EVMASK_MOTION;
+	case EVENT_BUTTON:
+		return EVMASK_BUTTON;
+	case EVENT_DEV:
+		return EVMASK_DEV;
+	case EVENT_CFG:
+		return EVMASK_CFG;
+	case EVENT_RAWAXIS:
+		return EVMASK_RAWAXIS;
+	case EVENT_RAWBUTTON:
+		return EVMASK_RAWBUTTON;
+	case EVENT_RAWFRAME:
+		return EVMASK_RAWFRAME;
+	default:
+		break;
+	}
+	return 0;
+}
+
 void broadcast_event(spnav_event *ev)
 {
 	struct client *c;
+	long long now;
+
+	if(!evmask_subscribed(event_evmask(ev->type))) {
+		return;
+	}
+
+	now = begin_event();
+	fanout_publish(ev, 0, -1, now);
+	shm_ring_publish(ev, 0, now);
 
 	c = first_client();
 	while(c) {
 		/* event masks will be checked at the protocol level (send_uevent) */
-		send_event(ev, c);
-		c = c->next;
+		if(!fanout_owns(c)) {
+			send_event(ev, c);
+		}
+		c = next_client(c);
 	}
 }
 
@@ -372,6 +486,20 @@ void broadcast_cfg_event(int cfg, int val)
 	broadcast_event(&ev);
 }
 
+/* invalidate the per-protocol encoded event caches before each fan-out,
+ * returns the event timestamp.
+ */
+static long long begin_event(void)
+{
+	long long now = get_usec();
+
+	uevent_begin(now);
+#ifdef USE_X11
+	xevent_begin();
+#endif
+	return now;
+}
+
 static void send_event(spnav_event *ev, struct client *c)
 {
 	switch(get_client_type(c)) {
@@ -32,7 +32,8 @@ enum {
 	EVENT_CFG,		/* configuration change */
 
 	EVENT_RAWAXIS,
-	EVENT_RAWBUTTON
+	EVENT_RAWBUTTON,
+	EVENT_RAWFRAME
 };
 
 enum { DEV_ADD, DEV_RM };
@@ -71,6 +72,13 @@ struct event_axis {
 	int value;
 };
 
+struct event_rawframe {
+	int type;
+	int dev;
+	int num_axes;
+	int16_t axes[RAWFRAME_AXES];
+};
+
 typedef union spnav_event {
 	int type;
 	struct event_motion motion;
@@ -78,6 +86,7 @@ typedef union spnav_event {
 	struct event_dev dev;
 	struct event_cfg cfg;
 	struct event_axis axis;
+	struct event_rawframe rawframe;
 } spnav_event;
 
 enum {
@@ -102,6 +111,12 @@ int in_deadzone(struct device *dev);
 /* dispatches the last event */
 void repeat_last_event(struct device *dev);
 
+/* the axis (0-5) a device axis is mapped to, after axismap and swapyz, or -1 */
+int dev_axis_mapping(int devaxis);
+
+/* event mask bit (EVMASK_*) which selects events of this type */
+unsigned int event_evmask(int evtype);
+
 /* broadcasts an event to all clients */
 void broadcast_event(spnav_event *ev);
 
@@ -0,0 +1,337 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+#include "fanout.h"
+#include "spnavd.h"
+
+#ifdef USE_THREADS
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "proto_unix.h"
+
+#define MAX_SHARDS	64
+#define RING_SIZE	256
+
+struct fanout_entry {
+	spnav_event ev;
+	struct device *dev;		/* only used for comparisons, never dereferenced */
+	int cls;
+	int defdev;				/* the event comes from the default device */
+	long long time;
+};
+
+struct shard {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	struct client *clients;
+	int num_clients;
+	unsigned long rd;		/* ring position, guarded by ring_lock */
+	struct enc_cache cache;
+};
+
+static void *worker(void *arg);
+static int wants_event(struct client *c, struct fanout_entry *ent);
+
+static struct shard shards[MAX_SHARDS];
+static int num_shards;
+
+static struct fanout_entry ring[RING_SIZE];
+static unsigned long ring_wr;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;		/* new entries */
+static pthread_cond_t ring_space = PTHREAD_COND_INITIALIZER;	/* entries consumed */
+static int quit;
+
+
+int init_fanout(int num_threads)
+{
+	int i;
+	pthread_mutexattr_t attr;
+
+	if(num_threads <= 0) return 0;
+	if(num_threads > MAX_SHARDS) {
+		num_threads = MAX_SHARDS;
+	}
+
+	/* recursive, because workers hold their shard lock while sending, and
+	 * sending also locks the client.
+	 */
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+	quit = 0;
+	for(i=0; i<num_threads; i++) {
+		struct shard *sh = shards + i;
+		memset(sh, 0, sizeof *sh);
+		sh->cache.serial = 1;
+		sh->rd = ring_wr;
+		pthread_mutex_init(&sh->lock, &attr);
+
+		if(pthread_create(&sh->thread, 0, worker, sh) != 0) {
+			logmsg(LOG_ERR, "failed to create fan-out thread, using %d threads\n", i);
+			pthread_mutex_destroy(&sh->lock);
+			break;
+		}
+		num_shards++;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	if(num_shards) {
+		logmsg(LOG_INFO, "delivering client events with %d threads\n", num_shards);
+	}
+	return 0;
+}
+
+void shutdown_fanout(void)
+{
+	int i;
+
+	if(!num_shards) return;
+
+	pthread_mutex_lock(&ring_lock);
+	quit = 1;
+	pthread_cond_broadcast(&ring_cond);
+	pthread_mutex_unlock(&ring_lock);
+
+	for(i=0; i<num_shards; i++) {
+		pthread_join(shards[i].thread, 0);
+		pthread_mutex_destroy(&shards[i].lock);
+	}
+	num_shards = 0;
+}
+
+int fanout_owns(struct client *c)
+{
+	return num_shards && c->type == CLIENT_UNIX && c->deliv_mode == DELIV_DEFAULT;
+}
+
+static unsigned long min_rd(void)
+{
+	int i;
+	unsigned long rd = shards[0].rd;
+
+	for(i=1; i<num_shards; i++) {
+		if(ring_wr - shards[i].rd > ring_wr - rd) {
+			rd = shards[i].rd;
+		}
+	}
+	return rd;
+}
+
+void fanout_publish(spnav_event *ev, struct device *dev, int cls, long long time)
+{
+	struct fanout_entry *ent;
+
+	if(!num_shards) return;
+
+	pthread_mutex_lock(&ring_lock);
+	while(ring_wr - min_rd() >= RING_SIZE) {
+		pthread_cond_wait(&ring_space, &ring_lock);
+	}
+
+	ent = ring + ring_wr % RING_SIZE;
+	ent->ev = *ev;
+	ent->dev = dev;
+	ent->cls = cls;
+	ent->defdev = dev && dev == get_devices();
+	ent->time = time;
+
+	ring_wr++;
+	pthread_cond_broadcast(&ring_cond);
+	pthread_mutex_unlock(&ring_lock);
+}
+
+void fanout_sync(void)
+{
+	if(!num_shards) return;
+
+	pthread_mutex_lock(&ring_lock);
+	while(min_rd() != ring_wr) {
+		pthread_cond_wait(&ring_space, &ring_lock);
+	}
+	pthread_mutex_unlock(&ring_lock);
+}
+
+void fanout_add_client(struct client *c)
+{
+	int i;
+	struct shard *sh;
+
+	if(!num_shards || c->type != CLIENT_UNIX) {
+		c->shard = -1;
+		return;
+	}
+
+	/* put the new client in the least loaded shard */
+	c->shard = 0;
+	for(i=1; i<num_shards; i++) {
+		if(shards[i].num_clients < shards[c->shard].num_clients) {
+			c->shard = i;
+		}
+	}
+	sh = shards + c->shard;
+
+	pthread_mutex_lock(&sh->lock);
+	c->sprev = 0;
+	c->snext = sh->clients;
+	if(sh->clients) sh->clients->sprev = c;
+	sh->clients = c;
+	sh->num_clients++;
+	pthread_mutex_unlock(&sh->lock);
+}
+
+void fanout_remove_client(struct client *c)
+{
+	struct shard *sh;
+
+	if(c->shard < 0) return;
+	sh = shards + c->shard;
+
+	pthread_mutex_lock(&sh->lock);
+	if(c->sprev) {
+		c->sprev->snext = c->snext;
+	} else {
+		sh->clients = c->snext;
+	}
+	if(c->snext) {
+		c->snext->sprev = c->sprev;
+	}
+	sh->num_clients--;
+	pthread_mutex_unlock(&sh->lock);
+
+	c->shard = -1;
+}
+
+void fanout_lock(struct client *c)
+{
+	if(c->shard >= 0) {
+		pthread_mutex_lock(&shards[c->shard].lock);
+	}
+}
+
+void fanout_unlock(struct client *c)
+{
+	if(c->shard >= 0) {
+		pthread_mutex_unlock(&shards[c->shard].lock);
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct shard *sh = arg;
+	struct fanout_entry *ent;
+	struct client *c;
+	unsigned long i, end;
+
+	pthread_mutex_lock(&ring_lock);
+	for(;;) {
+		while(sh->rd == ring_wr && !quit) {
+			pthread_cond_wait(&ring_cond, &ring_lock);
+		}
+		if(quit) break;
+		end = ring_wr;
+		pthread_mutex_unlock(&ring_lock);
+
+		pthread_mutex_lock(&sh->lock);
+		for(i=sh->rd; i!=end; i++) {
+			ent = ring + i % RING_SIZE;
+
+			enc_begin(&sh->cache, ent->time);
+			c = sh->clients;
+			while(c) {
+				if(wants_event(c, ent)) {
+					send_uevent_enc(&ent->ev, c, &sh->cache);
+				}
+				c = c->snext;
+			}
+		}
+
+		/* write out everything we queued in this batch */
+		c = sh->clients;
+		while(c) {
+			if(!c->dead && c->deliv_mode == DELIV_DEFAULT && uclient_pending(c)) {
+				flush_uclient(c);
+			}
+			c = c->snext;
+		}
+		pthread_mutex_unlock(&sh->lock);
+
+		pthread_mutex_lock(&ring_lock);
+		sh->rd = end;
+		pthread_cond_broadcast(&ring_space);
+	}
+	pthread_mutex_unlock(&ring_lock);
+	return 0;
+}
+
+static int wants_event(struct client *c, struct fanout_entry *ent)
+{
+	if(c->dead || c->deliv_mode != DELIV_DEFAULT) {
+		return 0;
+	}
+	if(ent->cls < 0) {
+		return 1;	/* not a device input event */
+	}
+	return c->subs ? client_subscribed_dev(c, ent->dev) : ent->defdev;
+}
+
+#else	/* !USE_THREADS */
+
+int init_fanout(int num_threads)
+{
+	if(num_threads > 0) {
+		logmsg(LOG_WARNING, "spacenavd was built without thread support, ignoring fanout-threads\n");
+	}
+	return 0;
+}
+
+void shutdown_fanout(void)
+{
+}
+
+int fanout_owns(struct client *c)
+{
+	return 0;
+}
+
+void fanout_publish(spnav_event *ev, struct device *dev, int cls, long long time)
+{
+}
+
+void fanout_sync(void)
+{
+}
+
+void fanout_add_client(struct client *c)
+{
+	c->shard = -1;
+}
+
+void fanout_remove_client(struct client *c)
+{
+}
+
+void fanout_lock(struct client *c)
+{
+}
+
+void fanout_unlock(struct client *c)
+{
+}
+#endif	/* USE_THREADS */
@@ -0,0 +1,54 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef FANOUT_H_
+#define FANOUT_H_
+
+#include "config.h"
+#include "event.h"
+#include "client.h"
+
+/* Optional worker pool for delivering events to UNIX clients. Clients are
+ * sharded across the worker threads, each writing to its own clients' sockets.
+ * The main thread publishes each event once into a broadcast ring, which all
+ * workers consume. Clients using a non-default motion delivery mode, and X11
+ * clients, are always served by the main thread.
+ *
+ * Without USE_THREADS, or with 0 threads, all of these are no-ops.
+ */
+int init_fanout(int num_threads);
+void shutdown_fanout(void);
+
+/* non-zero if events for this client are delivered by a worker thread */
+int fanout_owns(struct client *c);
+
+/* publish an event to the workers. For device input events cls is the event
+ * class (SUB_*) and dev the originating device, otherwise cls is -1.
+ */
+void fanout_publish(spnav_event *ev, struct device *dev, int cls, long long time);
+
+/* wait until the workers have processed everything published so far */
+void fanout_sync(void);
+
+void fanout_add_client(struct client *c);
+void fanout_remove_client(struct client *c);
+
+/* serialize access to client state shared with the client's worker thread */
+void fanout_lock(struct client *c);
+void fanout_unlock(struct client *c);
+
+#endif	/* FANOUT_H_ */
@@ -0,0 +1,329 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include "metrics.h"
+#include "proto.h"
+#include "client.h"
+#include "dev.h"
+#include "fanout.h"
+#include "proto_unix.h"
+#include "cfgfile.h"
+#include "spnavd.h"
+#include "logger.h"
+
+unsigned long metrics[NUM_METRICS];
+
+#define MAX_REQ_IDX		64
+
+/* 0x1000, 0x2000 and 0x3000 request ranges, and the rest */
+static unsigned long req_count[3][MAX_REQ_IDX];
+static unsigned long req_cfg[3];	/* REQ_CFG_SAVE, REQ_CFG_RESTORE, REQ_CFG_RESET */
+static unsigned long req_other;
+
+static const struct {
+	const char *name, *type, *help;
+} metric_info[NUM_METRICS] = {
+	{"spnavd_inputs_total", "counter", "Device inputs read."},
+	{"spnavd_events_total", "counter", "Events queued to UNIX socket clients."},
+	{"spnavd_drops_total", "counter", "Messages dropped because a client queue was full."},
+	{"spnavd_write_stalls_total", "counter", "Client writes cut short by a full socket buffer (EAGAIN)."},
+	{"spnavd_requests_total", "counter", "Client requests handled."},
+	{"spnavd_clients_accepted_total", "counter", "Client connections accepted."},
+	{"spnavd_clients_closed_total", "counter", "Client connections closed."},
+	{"spnavd_config_reloads_total", "counter", "Configuration file reloads."}
+};
+
+static char *text;
+static int text_size, text_len;
+
+static unsigned long written[NUM_METRICS];
+static char written_path[PATH_MAX];		/* stats file the counters were written to */
+static long long last_write;
+
+
+void metric_request(int req)
+{
+	int range, idx;
+
+	metric_inc(MET_REQUESTS);
+
+	req &= 0xffff;
+	range = (req >> 12) - 1;
+	idx = req & 0xfff;
+
+	if(range >= 0 && range < 3 && idx < MAX_REQ_IDX) {
+		counter_inc(req_count[range] + idx);
+	} else if(req >= REQ_CFG_SAVE && req <= REQ_CFG_RESET) {
+		counter_inc(req_cfg + req - REQ_CFG_SAVE);
+	} else {
+		counter_inc(&req_other);
+	}
+}
+
+static int append(const char *fmt, ...)
+{
+	int len;
+	char *tmp;
+	va_list ap;
+
+	for(;;) {
+		va_start(ap, fmt);
+		len = vsnprintf(text + text_len, text_size - text_len, fmt, ap);
+		va_end(ap);
+
+		if(len < text_size - text_len) break;
+
+		if(!(tmp = realloc(text, text_size ? text_size * 2 : 4096))) {
+			return -1;
+		}
+		text = tmp;
+		text_size = text_size ? text_size * 2 : 4096;
+	}
+	text_len += len;
+	return 0;
+}
+
+/* label values can't contain raw quotes, backslashes, or newlines */
+static const char *label(const char *str)
+{
+	static char buf[512];
+	char *dest = buf;
+
+	while(*str && dest < buf + sizeof buf - 3) {
+		switch(*str) {
+		case '"':
+		case '\\':
+			*dest++ = '\\';
+			*dest++ = *str;
+			break;
+		case '\n':
+			*dest++ = '\\';
+			*dest++ = 'n';
+			break;
+		default:
+			*dest++ = *str;
+		}
+		str++;
+	}
+	*dest = 0;
+	return buf;
+}
+
+static void header(const char *name, const char *type, const char *help)
+{
+	append("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void request_text(void)
+{
+	int i, j;
+	unsigned long val;
+	static const char **names[] = {spnav_reqnames_1000, spnav_reqnames_2000, spnav_reqnames_3000};
+	const int *num_names[] = {&spnav_reqnames_1000_size, &spnav_reqnames_2000_size, &spnav_reqnames_3000_size};
+	static const char *cfgnames[] = {"CFG_SAVE", "CFG_RESTORE", "CFG_RESET"};
+
+	header("spnavd_requests_by_type_total", "counter", "Client requests handled, by request type.");
+	for(i=0; i<3; i++) {
+		for(j=0; j<*num_names[i] && j<MAX_REQ_IDX; j++) {
+			if((val = counter_get(req_count[i] + j))) {
+				append("spnavd_requests_by_type_total{type=\"%s\"} %lu\n", names[i][j], val);
+			}
+		}
+	}
+	for(i=0; i<3; i++) {
+		if((val = counter_get(req_cfg + i))) {
+			append("spnavd_requests_by_type_total{type=\"%s\"} %lu\n", cfgnames[i], val);
+		}
+	}
+	if((val = counter_get(&req_other))) {
+		append("spnavd_requests_by_type_total{type=\"other\"} %lu\n", val);
+	}
+}
+
+static void device_text(void)
+{
+	int count = 0;
+	struct device *dev;
+
+	header("spnavd_device_inputs_total", "counter", "Inputs read, by device.");
+	dev = get_devices();
+	while(dev) {
+		append("spnavd_device_inputs_total{id=\"%d\",name=\"%s\"} %lu\n", dev->id,
+				label(dev->name), dev->num_inputs);
+		count++;
+		dev = dev->next;
+	}
+
+	header("spnavd_devices", "gauge", "Devices open.");
+	append("spnavd_devices %d\n", count);
+}
+
+static void client_text(struct client *req)
+{
+	int i, count = 0;
+	struct client *c;
+	static const char *names[] = {
+		"spnavd_client_events_total",
+		"spnavd_client_drops_total",
+		"spnavd_client_coalesced_total",
+		"spnavd_client_slow_total",
+		"spnavd_client_queued_bytes"
+	};
+	static const char *help[] = {
+		"Events queued, by client.",
+		"Messages dropped because the client queue was full, by client.",
+		"Motion events replaced by newer motion before being sent, by client.",
+		"Number of times the client fell behind.",
+		"Output waiting to be sent, by client."
+	};
+	unsigned long val;
+
+	/* one metric at a time, exposition requires them grouped */
+	for(i=0; i<5; i++) {
+		header(names[i], i < 4 ? "counter" : "gauge", help[i]);
+
+		c = first_client();
+		while(c) {
+			if(get_client_type(c) == CLIENT_UNIX && (!req || req->cold->uid == 0 ||
+						c->cold->uid == req->cold->uid)) {
+				fanout_lock(c);
+				switch(i) {
+				case 0:
+					val = counter_get(&c->num_events);
+					break;
+				case 1:
+					val = c->outq.dropped;
+					break;
+				case 2:
+					val = c->outq.overwritten;
+					break;
+				case 3:
+					val = c->cold->slow_count;
+					break;
+				default:
+					val = uclient_pending(c);
+				}
+				fanout_unlock(c);
+
+				append("%s{fd=\"%d\",name=\"%s\"} %lu\n", names[i], get_client_socket(c),
+						label(get_client_name(c)), val);
+			}
+			c = next_client(c);
+		}
+	}
+
+	c = first_client();
+	while(c) {
+		count++;
+		c = next_client(c);
+	}
+	header("spnavd_clients", "gauge", "Clients connected.");
+	append("spnavd_clients %d\n", count);
+}
+
+int metrics_text(char **textp, struct client *req)
+{
+	int i;
+
+	text_len = 0;
+	if(append("") == -1) {
+		return -1;
+	}
+
+	for(i=0; i<NUM_METRICS; i++) {
+		header(metric_info[i].name, metric_info[i].type, metric_info[i].help);
+		append("%s %lu\n", metric_info[i].name, counter_get(metrics + i));
+	}
+	request_text();
+	device_text();
+	client_text(req);
+
+	*textp = text;
+	return text_len;
+}
+
+static int metrics_dirty(void)
+{
+	int i;
+
+	/* write a new file at least once, even if nothing ever happens */
+	if(strcmp(cfg.stats_file, written_path) != 0) {
+		return 1;
+	}
+	for(i=0; i<NUM_METRICS; i++) {
+		if(counter_get(metrics + i) != written[i]) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void metrics_write_file(void)
+{
+	int i, len;
+	char *str, tmpname[PATH_MAX + 8];
+	FILE *fp;
+	long long now;
+
+	if(!cfg.stats_file[0] || !metrics_dirty()) return;
+
+	now = get_usec();
+	if(last_write && now - last_write < STATS_FILE_INTERVAL) {
+		return;
+	}
+	last_write = now;
+	for(i=0; i<NUM_METRICS; i++) {
+		written[i] = counter_get(metrics + i);
+	}
+	strcpy(written_path, cfg.stats_file);
+
+	if((len = metrics_text(&str, 0)) == -1) {
+		return;
+	}
+
+	/* write a new file and rename it, so that readers never see half of it */
+	sprintf(tmpname, "%s.tmp", cfg.stats_file);
+
+	if(!(fp = fopen(tmpname, "wb"))) {
+		logmsg(LOG_WARNING, "failed to write stats file: %s: %s\n", tmpname, strerror(errno));
+		return;
+	}
+	fwrite(str, 1, len, fp);
+	if(fclose(fp) == EOF || rename(tmpname, cfg.stats_file) == -1) {
+		logmsg(LOG_WARNING, "failed to write stats file: %s: %s\n", cfg.stats_file, strerror(errno));
+		remove(tmpname);
+	}
+}
+
+long long metrics_timeout(void)
+{
+	long long wait;
+
+	if(!cfg.stats_file[0] || !metrics_dirty()) {
+		return -1;
+	}
+	if((wait = last_write + STATS_FILE_INTERVAL - get_usec()) < 0) {
+		wait = 0;
+	}
+	return wait;
+}
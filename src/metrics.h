@@ -0,0 +1,69 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include "config.h"
+
+/* Daemon-wide counters, incremented on the hot paths from any thread with
+ * relaxed atomics, and read the same way. They are never reset.
+ */
+enum {
+	MET_INPUTS,			/* device inputs read */
+	MET_EVENTS,			/* events queued to UNIX clients */
+	MET_DROPS,			/* messages which didn't fit in a client queue */
+	MET_STALLS,			/* client writes cut short (EAGAIN, or socket buffer full) */
+	MET_REQUESTS,		/* client requests handled */
+	MET_CLIENTS_ACCEPTED,
+	MET_CLIENTS_CLOSED,
+	MET_CFG_RELOADS,	/* config file reloads (SIGHUP, REQ_CFG_RESTORE) */
+
+	NUM_METRICS
+};
+
+extern unsigned long metrics[NUM_METRICS];
+
+#define counter_add(p, n)	__atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define counter_inc(p)		counter_add(p, 1)
+#define counter_get(p)		__atomic_load_n((p), __ATOMIC_RELAXED)
+
+#define metric_add(m, n)	counter_add(metrics + (m), n)
+#define metric_inc(m)		counter_add(metrics + (m), 1)
+
+/* per request type counters */
+void metric_request(int req);
+
+struct client;
+
+/* Prometheus text exposition of all counters, plus per-device and per-client
+ * counters, and gauges. The per-client series are limited to the clients of
+ * the same user as req, unless req is null or belongs to root. Returns the
+ * length of the text; the buffer is reused by the next call. Main thread only.
+ */
+int metrics_text(char **textp, struct client *req);
+
+/* the stats-file option: writes the file when the option is first set, and
+ * rewrites it if any counter changed, at most once per STATS_FILE_INTERVAL. metrics_timeout returns the usec until the
+ * next due write, or -1 if nothing is pending.
+ */
+#define STATS_FILE_INTERVAL		1000000
+
+void metrics_write_file(void);
+long long metrics_timeout(void);
+
+#endif	/* METRICS_H_ */
@@ -0,0 +1,182 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "outq.h"
+
+#define OUTQ_INIT_SIZE	512
+
+void outq_destroy(struct outq *q)
+{
+	free(q->buf);
+	q->buf = 0;
+	q->size = q->head = q->count = 0;
+	free(q->motion);
+	q->motion = 0;
+	q->motion_size = 0;
+}
+
+static int grow(struct outq *q, int size)
+{
+	int newsz, tail;
+	char *tmp;
+
+	newsz = q->size ? q->size * 2 : OUTQ_INIT_SIZE;
+	while(newsz < size) newsz *= 2;
+
+	if(!(tmp = malloc(newsz))) {
+		return -1;
+	}
+	/* unwrap the existing contents at the start of the new buffer */
+	if(q->count) {
+		tail = q->size - q->head;
+		if(tail >= q->count) {
+			memcpy(tmp, q->buf + q->head, q->count);
+		} else {
+			memcpy(tmp, q->buf + q->head, tail);
+			memcpy(tmp + tail, q->buf, q->count - tail);
+		}
+	}
+	free(q->buf);
+	q->buf = tmp;
+	q->size = newsz;
+	q->head = 0;
+	return 0;
+}
+
+static int push(struct outq *q, const void *data, int size, int limit)
+{
+	int tail, len;
+
+	if(limit > 0 && q->count + size > limit) {
+		return -1;
+	}
+	if(q->count + size > q->size && grow(q, q->count + size) == -1) {
+		return -1;
+	}
+
+	tail = (q->head + q->count) % q->size;
+	len = q->size - tail;
+	if(len >= size) {
+		memcpy(q->buf + tail, data, size);
+	} else {
+		memcpy(q->buf + tail, data, len);
+		memcpy(q->buf, (char*)data + len, size - len);
+	}
+	q->count += size;
+	return 0;
+}
+
+static int push_msg(struct outq *q, const void *data, int size, int limit)
+{
+	/* any pending motion goes first, to keep the stream in order */
+	if(q->motion_size) {
+		if(push(q, q->motion, q->motion_size, limit) == -1) {
+			q->dropped++;
+			return -1;
+		}
+		q->motion_size = 0;
+	}
+	if(push(q, data, size, limit) == -1) {
+		q->dropped++;
+		return -1;
+	}
+	return 0;
+}
+
+int outq_push(struct outq *q, const void *data, int size)
+{
+	return push_msg(q, data, size, q->limit);
+}
+
+int outq_push_nolimit(struct outq *q, const void *data, int size)
+{
+	return push_msg(q, data, size, 0);
+}
+
+int outq_set_motion(struct outq *q, const void *data, int size)
+{
+	/* only clients which fall behind ever need the motion slot */
+	if(!q->motion && !(q->motion = malloc(OUTQ_MAX_MSG))) {
+		q->dropped++;
+		return -1;
+	}
+	if(q->motion_size) {
+		q->overwritten++;
+	}
+	memcpy(q->motion, data, size);
+	q->motion_size = size;
+	return 0;
+}
+
+int outq_pending(struct outq *q)
+{
+	return q->count + q->motion_size;
+}
+
+int outq_flush(struct outq *q, int fd)
+{
+	int len, wr, niov;
+	struct iovec iov[2];
+
+	/* the pending motion is newer than anything queued, so it goes last */
+	if(q->motion_size && push(q, q->motion, q->motion_size, q->limit) != -1) {
+		q->motion_size = 0;
+	}
+	if(!q->count) {
+		q->stalled = 0;
+		return 0;
+	}
+
+	/* the queued data wraps around the end of the buffer in at most 2 parts */
+	len = q->size - q->head;
+	if(len >= q->count) {
+		iov[0].iov_base = q->buf + q->head;
+		iov[0].iov_len = q->count;
+		niov = 1;
+	} else {
+		iov[0].iov_base = q->buf + q->head;
+		iov[0].iov_len = len;
+		iov[1].iov_base = q->buf;
+		iov[1].iov_len = q->count - len;
+		niov = 2;
+	}
+
+	while((wr = writev(fd, iov, niov)) == -1 && errno == EINTR);
+	if(wr == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK) {
+			q->stalled = 1;
+			return 0;
+		}
+		return -1;
+	}
+
+	q->head = (q->head + wr) % q->size;
+	q->count -= wr;
+	if(q->count) {
+		q->stalled = 1;		/* socket buffer full */
+	} else {
+		q->head = 0;
+		q->stalled = q->motion_size != 0;
+	}
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef OUTQ_H_
+#define OUTQ_H_
+
+/* Outbound message queue of a client. Messages are only ever queued whole,
+ * and stay in order, so the client never sees a torn message. Motion messages
+ * can go to a latest-wins slot instead, which overwrites any unsent motion
+ * rather than growing the queue.
+ */
+#define OUTQ_MAX_MSG	40		/* fits compact events (CEV_MAX_SIZE) */
+
+struct outq {
+	char *buf;
+	int size, limit;		/* allocated size and max bytes queued */
+	int head, count;		/* start offset and number of bytes queued */
+	int stalled;			/* the last flush couldn't write everything */
+
+	int motion_size;		/* size of the pending motion message, 0 if none */
+	char *motion;			/* OUTQ_MAX_MSG bytes, allocated on first use */
+
+	/* statistics */
+	unsigned long overwritten;	/* motion messages replaced before being sent */
+	unsigned long dropped;		/* messages dropped due to the queue limit */
+};
+
+void outq_destroy(struct outq *q);
+
+/* returns -1 if the message doesn't fit within the queue limit */
+int outq_push(struct outq *q, const void *data, int size);
+/* queues the message past the limit, for output which must not be lost. Only
+ * fails if memory allocation fails.
+ */
+int outq_push_nolimit(struct outq *q, const void *data, int size);
+/* replace the pending motion message, returns -1 if it's dropped instead */
+int outq_set_motion(struct outq *q, const void *data, int size);
+
+/* number of bytes waiting to be sent, including the motion slot */
+int outq_pending(struct outq *q);
+
+/* writes as much as the socket accepts with a single writev, returns -1 on
+ * write errors.
+ */
+int outq_flush(struct outq *q, int fd);
+
+#endif	/* OUTQ_H_ */
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #define DEF_PROTO_REQ_NAMES
 #include "proto.h"
 
@@ -31,6 +32,41 @@ int spnav_send_str(int fd, int req, const char *str)
 	return 0;
 }
 
+int spnav_send_longstr(int fd, int req, const char *str)
+{
+	int len, niov = 0;
+	struct reqresp rr = {0};
+	struct iovec iov[3];
+	static const char pad[32];
+
+	if(fd == -1) {
+		return -1;
+	}
+
+	len = str ? strlen(str) : 0;
+	if(len > REQSTR_MAX_LEN) {
+		return -1;
+	}
+	rr.type = req;
+	rr.data[6] = len | REQSTR_LONG_BIT;
+
+	iov[niov].iov_base = &rr;
+	iov[niov++].iov_len = sizeof rr;
+	if(len) {
+		iov[niov].iov_base = (void*)str;
+		iov[niov++].iov_len = len;
+	}
+	if(REQSTR_PADLEN(len) > len) {
+		iov[niov].iov_base = (void*)pad;
+		iov[niov++].iov_len = REQSTR_PADLEN(len) - len;
+	}
+
+	if(writev(fd, iov, niov) != (int)sizeof rr + REQSTR_PADLEN(len)) {
+		return -1;
+	}
+	return 0;
+}
+
 int spnav_recv_str(struct reqresp_strbuf *sbuf, struct reqresp *rr)
 {
 	int len;
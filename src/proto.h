@@ -10,7 +10,7 @@
 #endif
 
 /* maximum supported protocol version */
-#define MAX_PROTO_VER	1
+#define MAX_PROTO_VER	2
 
 enum {
 	UEV_MOTION,
@@ -20,6 +20,8 @@ enum {
 	UEV_CFG,
 	UEV_RAWAXIS,
 	UEV_RAWBUTTON,
+	UEV_MOTION_ACCUM,	/* accumulated displacement (DELIV_ACCUM delivery mode) */
+	UEV_RAWFRAME,		/* all raw axes of a device input frame, see below */
 
 	MAX_UEV
 };
@@ -29,6 +31,194 @@ struct reqresp {
 	int32_t data[7];
 };
 
+/* UEV_RAWFRAME event layout (EVMASK_RAWFRAME)
+ * One event per device input frame, with the raw values of all axes, sent
+ * instead of a UEV_RAWAXIS per changed axis:
+ *   data[1]: device id
+ *   data[2]: timestamp (monotonic usec, low 32 bits)
+ *   data[3]: number of axes in the frame
+ *   data[4-7]: axis values, 16 bits each, axis 2n in the low half of data[4 + n]
+ *              and axis 2n+1 in the high half. Values outside the 16 bit range
+ *              are clamped to -32768 or 32767; the shared memory state page
+ *              (REQ_DEV_STATE) has the full 32 bit values.
+ */
+#define RAWFRAME_AXES	8
+
+/* Protocol v2 output (daemon to client) is a stream of frames, each made of a
+ * frame header followed by one or more records. Requests from the client, and
+ * the reply to the protocol change request itself, are the same as in v1.
+ * All fields are in host byte order, and record sizes are multiples of 8.
+ */
+struct frame_hdr {
+	uint32_t size;		/* frame size in bytes, including the header */
+	uint32_t count;		/* number of records in the frame */
+};
+
+struct rec_hdr {
+	uint16_t type;		/* UEV_* for events, or REC_* */
+	uint16_t size;		/* record size in bytes, including the header */
+	uint32_t seq;		/* per-client record sequence number */
+	uint64_t time;		/* CLOCK_MONOTONIC timestamp in microseconds */
+};
+
+/* Record types other than events. Clients must skip records of unknown types.
+ * Event records carry the same 7 data items as v1 events (data[1-7]), padded
+ * to 8 items. Every record gets the next sequence number, so that a gap means
+ * that records were lost, and a REC_DROP record follows the gap.
+ */
+enum {
+	REC_RESPONSE = 0x100,	/* request response: struct reqresp */
+	REC_DROP				/* records lost: uint32_t count, uint32_t seq of the last lost record */
+};
+
+/* Shared memory event ring (REQ_SET_TRANSPORT with TRANSPORT_SHM_RING)
+ * The daemon writes every event once into a ring of num_slots records in a
+ * shared memory object, and signals the eventfd passed along with it, after
+ * each batch of events. All ring clients read the same records: the ring has
+ * the events selected by the event mask of any ring client, from all devices,
+ * without client sensitivity, filters or delivery modes applied. Motion is
+ * left out while a client holds an exclusive active claim. Selections which
+ * the ring can't honour are refused: REQ_SET_TRANSPORT fails for clients with
+ * EVMASK_ACTIVE_ONLY, an exclusive active claim, or subscriptions to specific
+ * devices, and ring clients can't make any of these selections later.
+ *
+ * Records are numbered from 1, and record n is in slot n % num_slots. To read
+ * record n: wait until head >= n, load the slot seq, copy the record, and load
+ * the slot seq again. If either seq load doesn't match n, the daemon has
+ * overwritten the record, and the client should skip ahead to head - num_slots
+ * + 1. Loads of head and seq need acquire ordering.
+ */
+#define SHM_RING_MAGIC	0x53504e52	/* "SPNR" */
+
+struct shm_ring_hdr {
+	uint32_t magic;
+	uint32_t num_slots;
+	uint32_t slot_size;		/* bytes per slot, and offset of the first slot */
+	uint32_t reserved;
+	uint64_t head;			/* number of the last record written */
+};
+
+struct shm_rec {
+	uint64_t seq;			/* number of the record in this slot, 0 while being written */
+	uint64_t time;			/* CLOCK_MONOTONIC timestamp in microseconds */
+	int32_t type;			/* UEV_* */
+	int32_t dev;			/* originating device id, or -1 */
+	int32_t data[7];		/* event data, as in v1 data[1-7] */
+	int32_t pad[3];
+};
+
+/* Shared device state page (REQ_DEV_STATE)
+ * Holds the latest input state of a device, updated under a seqlock as input
+ * is processed. To read it: load seq, and retry if it's odd, copy the state,
+ * then load seq again, and retry if it changed. Loads of seq need acquire
+ * ordering.
+ */
+#define SHM_DEVSTATE_MAGIC	0x53504e53	/* "SPNS" */
+#define SHM_DEVSTATE_AXES	64
+
+struct shm_devstate {
+	uint32_t magic;
+	uint32_t seq;			/* odd while the state is being updated */
+	uint64_t generation;	/* number of updates so far */
+	uint64_t time;			/* CLOCK_MONOTONIC time of the last update (usec) */
+	int32_t dev;			/* device id */
+	int32_t num_axes, num_buttons;
+	int32_t removed;		/* set when the device is removed, no more updates */
+	int32_t motion[6];		/* transformed axes, as in motion events (no client sensitivity) */
+	int32_t raw[SHM_DEVSTATE_AXES];	/* raw axis values */
+	uint32_t buttons[2];	/* pressed (mapped) buttons bitmask, button n is bit n % 32 of buttons[n / 32] */
+};
+
+/* Shared configuration page (REQ_GCFG_SHM)
+ * Snapshot of the effective configuration, rewritten in place under a seqlock
+ * (same as the device state page), whenever the configuration changes. The
+ * generation counter is incremented with every change.
+ */
+#define SHM_CFG_MAGIC	0x53504e43	/* "SPNC" */
+#define SHM_CFG_AXES	64
+#define SHM_CFG_BUTTONS	64
+#define SHM_CFG_KEYS	8
+
+struct shm_cfg {
+	uint32_t magic;
+	uint32_t seq;			/* odd while the configuration is being rewritten */
+	uint64_t generation;	/* number of configuration changes */
+
+	float sensitivity, sens_trans[3], sens_rot[3];
+	int32_t swapyz, led, grab, repeat_msec;
+	int32_t dead_threshold[SHM_CFG_AXES];
+	int32_t invert[SHM_CFG_AXES];
+	int32_t map_axis[SHM_CFG_AXES];
+	int32_t map_button[SHM_CFG_BUTTONS];
+	int32_t bnact[SHM_CFG_BUTTONS];
+	int32_t kbmap_count[SHM_CFG_BUTTONS];
+	uint32_t kbmap[SHM_CFG_BUTTONS][SHM_CFG_KEYS];	/* keysyms */
+	char serial_dev[256];
+};
+
+/* Compact event encoding (REQ_SET_EVENC with EVENC_COMPACT)
+ * Each event is a tag byte (the UEV_* type), followed by a byte with bit n
+ * set if data[n + 1] of the v1 encoding of the event is non-zero, followed by
+ * those non-zero values only, zigzag encoded as LEB128 varints. Values left
+ * out are 0; axes at rest cost nothing, and typical motion values take 1 or 2
+ * bytes. There is no state carried from one event to the next.
+ * For protocol v1 clients, responses are prefixed with a CEV_RESPONSE tag byte
+ * and are otherwise unchanged. For protocol v2 clients the record type is the
+ * tag, and the record payload is the rest of the compact event.
+ */
+#define CEV_RESPONSE	0xff
+#define CEV_MAX_SIZE	37		/* tag, bitmap, 7 5-byte varints */
+
+enum {
+	EVENC_DEFAULT,
+	EVENC_COMPACT
+};
+
+/* Event filter (REQ_SET_FILTER/REQ_GET_FILTER)
+ * Evaluated by the daemon for each event, before it's queued to the client:
+ *   Q[0]: bits 0-5 axes to pass, bits 16-31 minimum change of any axis since
+ *         the last motion event passed, for a new one to be sent
+ *   Q[1-2]: buttons to pass, button n is bit n % 32 of Q[1 + n / 32]
+ *   Q[3-5]: per-axis magnitude thresholds, 16 bits each, axis 2n in the low
+ *         half of Q[3 + n] and axis 2n+1 in the high half
+ * Masked out axes, and values below the axis threshold, are reported as 0.
+ * Motion events which end up all zero are only sent once, when the device
+ * comes to rest. Button masks apply to both regular and raw button events.
+ * Raw axes (UEV_RAWAXIS, UEV_RAWFRAME) are filtered by the axis they are
+ * mapped to (axismap, swapyz): a UEV_RAWAXIS of a masked out axis is dropped,
+ * masked out axes of a UEV_RAWFRAME are reported as 0, and thresholds apply
+ * as for motion. Raw axes which aren't mapped to any axis only pass if all
+ * axes do. The change threshold doesn't apply to raw events.
+ * The default filter (0x3f, all buttons, no thresholds) passes everything.
+ */
+#define FILTER_AXIS_MASK		0x3f
+#define FILTER_DELTA_SHIFT		16
+
+/* Configuration batches (REQ_SCFG_BATCH/REQ_GCFG_BATCH)
+ * A batch is an array of tuples, transferred like a string (24 bytes per
+ * packet, remaining length in Q[6]/R[6]). The key is the REQ_SCFG_* request
+ * which would set the option, and the index selects the axis or button for
+ * the per-axis/per-button options (ignored otherwise). Float options carry
+ * the bit pattern of the float value. REQ_SCFG_SERDEV can't be batched.
+ * A batch is validated in full before any of it is applied; on success a
+ * single EVENT_CFG is broadcast, with cfg set to REQ_SCFG_BATCH and data[0]
+ * set to the number of tuples.
+ * REQ_GCFG_BATCH returns SENS, SENS_AXIS (6), DEADZONE/INVERT/AXISMAP (per
+ * axis), BNMAP/BNACTION (per button), KBMAP (per button, only if the daemon
+ * was built with X11 support, 0 for unmapped buttons), SWAPYZ, LED, GRAB and
+ * REPEAT, and can always be sent back as a REQ_SCFG_BATCH.
+ */
+#define CFG_BATCH_MAX	1024
+
+struct cfg_tuple {
+	int32_t key, idx, val;
+};
+
+enum {
+	TRANSPORT_SOCKET,		/* events are written to the socket */
+	TRANSPORT_SHM_RING		/* events go to the shared memory ring */
+};
+
 struct reqresp_strbuf {
 	char *buf, *endp;
 	int size;
@@ -54,6 +244,20 @@ enum {
 	REQ_GET_SENS,			/* get client sensitivity:	R[0] float R[6] status */
 	REQ_SET_EVMASK,			/* set event mask: Q[0] mask - R[6] status */
 	REQ_GET_EVMASK,			/* get event mask: R[0] mask R[6] status */
+	REQ_SET_DELIVERY,		/* set motion delivery mode: Q[0] mode Q[1-5] mode params - R[6] status */
+	REQ_GET_DELIVERY,		/* get motion delivery mode: R[0] mode R[1-5] mode params R[6] status */
+	REQ_SET_ACTIVE,			/* claim/release active status: Q[0] active Q[1] flags - R[6] status */
+	REQ_GET_ACTIVE,			/* get active status: R[0] active R[1] flags R[2] any client active R[6] status */
+	REQ_SET_TRANSPORT,		/* set event transport: Q[0] transport - R[0] ring slots R[1] slot size R[6] status
+							 * for TRANSPORT_SHM_RING the ring memfd and eventfd come with the response (SCM_RIGHTS) */
+	REQ_SET_STRMODE,		/* set string transfer mode: Q[0] mode - R[0] max string length R[6] status */
+	REQ_SET_EVENC,			/* set event encoding: Q[0] encoding - R[6] status */
+	REQ_SET_FILTER,			/* set event filter: Q[0-5] filter (see below) - R[6] status */
+	REQ_GET_FILTER,			/* get event filter: R[0-5] filter R[6] status */
+	REQ_GET_STATS,			/* get daemon counters: R[0-5] next 24 bytes R[6] remaining length
+							 * Prometheus text format, see stats-file in example-spnavrc.
+							 * Per-client series only for the clients of the same user,
+							 * ends with STATS_TRUNC_MSG if cut off at REQSTR_MAX_LEN */
 
 	/* device queries */
 	REQ_DEV_NAME = 0x2000,	/* get device name:	R[0-5] next 24 bytes R[6] remaining length or -1 for failure */
@@ -62,6 +266,10 @@ enum {
 	REQ_DEV_NBUTTONS,		/* get number of buttons: same as above */
 	REQ_DEV_USBID,			/* get USB id:			R[0] vend R[1] prod R[6] status */
 	REQ_DEV_TYPE,			/* get device type:		R[0] type enum R[6] status */
+	REQ_DEV_SUBSCRIBE,		/* get input from device:	Q[0] device id (-1: all) - R[6] status */
+	REQ_DEV_UNSUBSCRIBE,	/* stop input from device:	Q[0] device id (-1: all) - R[6] status */
+	REQ_DEV_STATE,			/* get device state page:	R[0] device id R[1] size R[6] status
+							 * the shared memory fd comes with the response (SCM_RIGHTS) */
 	/* TODO: features like LCD, LEDs ... */
 
 	/* configuration settings */
@@ -91,6 +299,10 @@ enum {
 	REQ_GCFG_SERDEV,		/* get serial device path:	R[0-5] next 24 bytes R[6] remaining length or -1 for failure */
 	REQ_SCFG_REPEAT,		/* set repeat interval:		Q[0] interval (msec) - R[6] status */
 	REQ_GCFG_REPEAT,		/* get repeat interval:		R[0] interval (msec) R[6] status */
+	REQ_GCFG_SHM,			/* get shared config page:	R[0] size R[6] status
+							 * the shared memory fd comes with the response (SCM_RIGHTS) */
+	REQ_SCFG_BATCH,			/* set multiple options:	Q[0-5] next 24 bytes Q[6] remaining length - R[0] failed tuple or -1 R[6] status */
+	REQ_GCFG_BATCH,			/* get whole config:		R[0-5] next 24 bytes R[6] remaining length or -1 for failure */
 	/* TODO ... more */
 	REQ_CFG_SAVE = 0x3ffe,	/* save config file:        R[6] status */
 	REQ_CFG_RESTORE,		/* load config from file:   R[6] status */
@@ -99,6 +311,23 @@ enum {
 	REQ_CHANGE_PROTO	= 0x5500
 };
 
+/* delivery mode parameters (REQ_SET_DELIVERY)
+ * DELIV_ACCUM: none
+ * DELIV_RESAMPLE: Q[1] tick rate (Hz, float) Q[2] tick phase (usec, relative to
+ *   the CLOCK_MONOTONIC epoch)
+ * DELIV_RATELIMIT: Q[1] minimum interval (usec) Q[2] merge policy (MERGE_*),
+ *   R[3] number of motion events merged so far
+ */
+
+/* active client arbitration (REQ_SET_ACTIVE)
+ * A client claims the active status when it gains focus, and releases it when
+ * it loses it. Only one client is active at a time, and a new claim takes over
+ * from the previous active client. Clients which set EVMASK_ACTIVE_ONLY (0x40)
+ * receive motion events only while they are active. With the ACTIVE_EXCLUSIVE
+ * flag (1), motion goes only to the active client, and claims by other clients
+ * fail until it's released. Button and other events are not affected.
+ */
+
 /* XXX keep in sync with SPNAV_DEV_* in spnav.h (libspnav) */
 enum {
 	DEV_UNKNOWN,
@@ -132,10 +361,35 @@ enum {
 
 #define REQSTR_CHUNK_SIZE	24
 #define REQSTR_CONT_BIT		0x10000
+#define REQSTR_LONG_BIT		0x20000
 #define REQSTR_FIRST(rr)	(((rr)->data[6] & REQSTR_CONT_BIT) == 0)
 #define REQSTR_REMLEN(rr)	((rr)->data[6] & 0xffff)
+#define REQSTR_LONG(rr)		(((rr)->data[6] & REQSTR_LONG_BIT) != 0)
+#define REQSTR_MAX_LEN		0xffff
+/* size of a long string payload, padded to keep requests aligned */
+#define REQSTR_PADLEN(len)	(((len) + 31) & ~31)
+
+/* last line of a REQ_GET_STATS response which didn't fit */
+#define STATS_TRUNC_MSG		"# truncated, see the stats-file for the rest\n"
+
+/* String transfer modes (REQ_SET_STRMODE)
+ * Strings are sent in 24 byte chunks, one request/response per chunk, unless
+ * the client selects STRMODE_LONG. In long mode a string is sent as a single
+ * request/response with Q[6]/R[6] set to the length | REQSTR_LONG_BIT, and
+ * Q[0-5] unused, immediately followed by the string bytes padded with zeros
+ * to a multiple of 32 bytes. The daemon accepts long strings from any client,
+ * the mode only selects the form of strings sent back to the client.
+ * The REQ_SET_STRMODE response gives the longest string the daemon sends in
+ * one response; it's less than REQSTR_MAX_LEN for protocol v2, where the whole
+ * response has to fit in a record. Longer strings are still sent in chunks.
+ */
+enum {
+	STRMODE_CHUNKED,
+	STRMODE_LONG
+};
 
 int spnav_send_str(int fd, int req, const char *str);
+int spnav_send_longstr(int fd, int req, const char *str);
 int spnav_recv_str(struct reqresp_strbuf *sbuf, struct reqresp *rr);
 
 #ifdef DEF_PROTO_REQ_NAMES
@@ -144,7 +398,17 @@ const char *spnav_reqnames_1000[] = {
 	"SET_SENS",
 	"GET_SENS",
 	"SET_EVMASK",
-	"GET_EVMASK"
+	"GET_EVMASK",
+	"SET_DELIVERY",
+	"GET_DELIVERY",
+	"SET_ACTIVE",
+	"GET_ACTIVE",
+	"SET_TRANSPORT",
+	"SET_STRMODE",
+	"SET_EVENC",
+	"SET_FILTER",
+	"GET_FILTER",
+	"GET_STATS"
 };
 const char *spnav_reqnames_2000[] = {
 	"DEV_NAME",
@@ -152,7 +416,10 @@ const char *spnav_reqnames_2000[] = {
 	"DEV_NAXES",
 	"DEV_NBUTTONS",
 	"DEV_USBID",
-	"DEV_TYPE"
+	"DEV_TYPE",
+	"DEV_SUBSCRIBE",
+	"DEV_UNSUBSCRIBE",
+	"DEV_STATE"
 };
 const char *spnav_reqnames_3000[] = {
 	"SCFG_SENS",
@@ -180,7 +447,10 @@ const char *spnav_reqnames_3000[] = {
 	"SCFG_SERDEV",
 	"GCFG_SERDEV",
 	"SCFG_REPEAT",
-	"GCFG_REPEAT"
+	"GCFG_REPEAT",
+	"GCFG_SHM",
+	"SCFG_BATCH",
+	"GCFG_BATCH"
 };
 
 const int spnav_reqnames_1000_size = sizeof spnav_reqnames_1000 / sizeof *spnav_reqnames_1000;
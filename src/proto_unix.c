@@ -16,6 +16,9 @@ You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE	/* accept4, struct ucred */
+#endif
 #include "config.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,9 +30,14 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <sys/ioctl.h>
 #include "proto.h"
 #include "proto_unix.h"
 #include "spnavd.h"
+#include "deliver.h"
+#include "fanout.h"
+#include "shm.h"
+#include "metrics.h"
 #ifdef USE_X11
 #include "kbemu.h"
 #endif
@@ -41,7 +49,23 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 static int lsock = -1;
 
 
+/* number of connections per user, for enforcing max-clients-per-user */
+struct uid_count {
+	uid_t uid;
+	int count;
+};
+static struct uid_count *uid_counts;
+static int num_uid_counts, max_uid_counts;
+
+static void accept_clients(void);
+static void uid_count_dec(uid_t uid);
+static void queue_full(struct client *c);
+static void frame_close(struct client *c);
+static int read_requests(struct client *c);
+static void resume_requests(struct client *c);
+static int end_longstr(struct client *c);
 static int handle_request(struct client *c, struct reqresp *req);
+static int sendstr(struct client *c, int req, const char *str);
 static const char *reqstr(int req);
 
 int init_unix(void)
@@ -73,7 +97,10 @@ int init_unix(void)
 
 	umask(prev_umask);
 
-	if(listen(s, 8) == -1) {
+	/* accept in a loop until there are no more pending connections */
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+
+	if(listen(s, cfg.listen_backlog) == -1) {
 		logmsg(LOG_ERR, "listen failed: %s\n", strerror(errno));
 		close(s);
 		unlink(SOCK_NAME);
@@ -99,211 +126,1413 @@ int get_unix_socket(void)
 	return lsock;
 }
 
-void send_uevent(spnav_event *ev, struct client *c)
+/* Encoded events are cached for the duration of each fan-out, keyed by the
+ * client sensitivity (the only per-client input to the encoding), so that
+ * each event is serialized only once for all clients which share it.
+ */
+static struct enc_cache enc_cache = {{{0}}, 0, 1};
+
+void uevent_begin(long long time)
+{
+	enc_begin(&enc_cache, time);
+}
+
+void enc_begin(struct enc_cache *cache, long long time)
+{
+	cache->serial++;
+	cache->time = time;
+}
+
+static int32_t *encode_uevent(struct enc_cache *cache, spnav_event *ev, float sens)
 {
 	int i;
-	int32_t data[8] = {0};
-	float motion_mul;
+	struct enc_entry *ent;
+	int32_t *data;
+
+	for(i=0; i<ENC_CACHE_SIZE; i++) {
+		ent = cache->ent + i;
+		if(ent->serial == cache->serial && ent->sens == sens) {
+			return ent->data;
+		}
+	}
+
+	ent = cache->ent + cache->next;
+	cache->next = (cache->next + 1) % ENC_CACHE_SIZE;
+	ent->serial = cache->serial;
+	ent->sens = sens;
+
+	data = ent->data;
+	memset(data, 0, sizeof ent->data);
+
+	switch(ev->type) {
+	case EVENT_MOTION:
+		data[0] = UEV_MOTION;
+		for(i=0; i<6; i++) {
+			float val = (float)ev->motion.data[i] * sens;
+			data[i + 1] = (int32_t)val;
+		}
+		data[7] = ev->motion.period;
+		break;
+
+	case EVENT_RAWAXIS:
+		data[0] = UEV_RAWAXIS;
+		data[1] = ev->axis.idx;
+		data[2] = ev->axis.value;
+		break;
+
+	case EVENT_BUTTON:
+		data[0] = ev->button.press ? UEV_PRESS : UEV_RELEASE;
+		data[1] = ev->button.bnum;
+		data[2] = ev->button.press;
+		break;
+
+	case EVENT_RAWBUTTON:
+		data[0] = UEV_RAWBUTTON;
+		data[1] = ev->button.bnum;
+		data[2] = ev->button.press;
+		break;
+
+	case EVENT_RAWFRAME:
+		data[0] = UEV_RAWFRAME;
+		data[1] = ev->rawframe.dev;
+		data[2] = (int32_t)cache->time;
+		data[3] = ev->rawframe.num_axes;
+		for(i=0; i<RAWFRAME_AXES / 2; i++) {
+			data[4 + i] = (uint16_t)ev->rawframe.axes[i * 2] |
+				((uint32_t)(uint16_t)ev->rawframe.axes[i * 2 + 1] << 16);
+		}
+		break;
+
+	case EVENT_DEV:
+		data[0] = UEV_DEV;
+		data[1] = ev->dev.op;
+		data[2] = ev->dev.id;
+		data[3] = ev->dev.devtype;
+		data[4] = ev->dev.usbid[0];
+		data[5] = ev->dev.usbid[1];
+		break;
+
+	case EVENT_CFG:
+		data[0] = UEV_CFG;
+		data[1] = ev->cfg.cfg;
+		memcpy(data + 2, ev->cfg.data, sizeof ev->cfg.data);
+		break;
+
+	default:
+		ent->serial = 0;
+		return 0;
+	}
+	return data;
+}
+
+void send_uevent(spnav_event *ev, struct client *c)
+{
+	send_uevent_enc(ev, c, &enc_cache);
+}
+
+int32_t *uevent_data(spnav_event *ev)
+{
+	return encode_uevent(&enc_cache, ev, 1.0f);
+}
+
+void send_uevent_enc(spnav_event *ev, struct client *c, struct enc_cache *cache)
+{
+	int32_t *data;
+	float sens = 1.0f;
 
 	if(lsock == -1) return;
 
-	switch(ev->type) {
-	case EVENT_MOTION:
-		if(!(c->evmask & EVMASK_MOTION)) return;
+	if(!(c->evmask & event_evmask(ev->type))) return;
+
+	/* shared ring clients read their events from the ring */
+	if(c->ring) return;
+
+	/* raw events are the first to go when a client falls behind */
+	if(c->slow && (ev->type == EVENT_RAWAXIS || ev->type == EVENT_RAWBUTTON ||
+				ev->type == EVENT_RAWFRAME)) {
+		return;
+	}
+
+	if(ev->type == EVENT_MOTION) {
+		if(!client_wants_motion(c)) {
+			return;
+		}
+		if(c->deliv_mode != DELIV_DEFAULT) {
+			deliver_motion(c, ev);
+			return;
+		}
+		sens = get_client_sensitivity(c);
+	}
+
+	if(!(data = encode_uevent(cache, ev, sens))) {
+		return;
+	}
+
+	if(c->deliv_mode != DELIV_DEFAULT && ev->type != EVENT_RAWAXIS && ev->type != EVENT_RAWFRAME) {
+		deliver_flush(c);	/* don't let held back motion overtake this event */
+	}
+
+	if(ev->type == EVENT_MOTION) {
+		send_uevmotion(c, data, cache->time);
+	} else {
+		send_uevmsg(c, data, cache->time);
+	}
+}
+
+static int kernel_outq(struct client *c)
+{
+#ifdef SIOCOUTQ
+	int outq;
+	if(ioctl(get_client_socket(c), SIOCOUTQ, &outq) != -1) {
+		return outq;
+	}
+#endif
+	return -1;
+}
+
+void flush_uclient(struct client *c)
+{
+	if(c->cold->frame.count) {
+		frame_close(c);
+	}
+	if(outq_flush(&c->outq, get_client_socket(c)) == -1) {
+		c->dead = 1;
+		return;
+	}
+	if(c->outq.stalled) {
+		metric_inc(MET_STALLS);
+	}
+
+	if(c->outq.count > c->outq.limit / 2) {
+		if(!c->slow) {
+			c->slow = 1;
+			c->cold->slow_count++;
+			logmsg(LOG_INFO, "client %s is falling behind (queued: %d, socket: %d bytes)\n",
+					get_client_name(c), c->outq.count, kernel_outq(c));
+		}
+	} else if(c->slow && !outq_pending(&c->outq)) {
+		c->slow = 0;
+		logmsg(LOG_INFO, "client %s caught up\n", get_client_name(c));
+	}
+}
+
+static void queue_full(struct client *c)
+{
+	metric_inc(MET_DROPS);
+	if(cfg.slow_client_policy == SLOW_DISCONNECT) {
+		logmsg(LOG_WARNING, "disconnecting client %s: output queue full\n",
+				get_client_name(c));
+		c->dead = 1;
+	} else if(!c->slow) {
+		c->slow = 1;
+		c->cold->slow_count++;
+	}
+}
+
+/* lossless messages are queued behind any output the client hasn't read yet,
+ * up to the queue limit, which responses are exempt from: a client waiting for
+ * a response would wait forever if it was dropped. Request handling is held
+ * back instead while the client is behind (see requests_held). Unless
+ * configured for immediate writes, the queue is written out by flush_uevents,
+ * at the end of the frame or loop iteration.
+ */
+static int queue_umsg(struct client *c, const void *data, int size, int resp)
+{
+	int res = 0;
+
+	fanout_lock(c);
+	if(c->dead) {
+		res = -1;
+		goto end;
+	}
+
+	c->outq.limit = cfg.client_queue_limit;
+	if((resp ? outq_push_nolimit(&c->outq, data, size) : outq_push(&c->outq, data, size)) == -1) {
+		queue_full(c);
+		res = -1;
+		goto end;
+	}
+	if(cfg.client_flush == FLUSH_IMMEDIATE && !c->cold->in_requests) {
+		flush_uclient(c);
+	}
+	if(c->dead) res = -1;
+end:
+	fanout_unlock(c);
+	return res;
+}
+
+int send_umsg(struct client *c, const void *data, int size)
+{
+	return queue_umsg(c, data, size, 0);
+}
+
+/* motion messages only keep the latest unsent one, if the client is behind */
+int send_umotion(struct client *c, const void *data, int size)
+{
+	int res;
+
+	fanout_lock(c);
+	if(c->dead) {
+		res = -1;
+	} else if(c->outq.stalled) {
+		res = outq_set_motion(&c->outq, data, size);
+	} else {
+		res = send_umsg(c, data, size);
+	}
+	fanout_unlock(c);
+	return res;
+}
+
+#define FRAME_INIT_SIZE	256
+
+static int frame_reserve(struct uframe *f, int size)
+{
+	int newsz;
+	char *tmp;
+
+	if(f->len + size <= f->size) {
+		return 0;
+	}
+	newsz = f->size ? f->size * 2 : FRAME_INIT_SIZE;
+	while(newsz < f->len + size) newsz *= 2;
+
+	if(!(tmp = realloc(f->buf, newsz))) {
+		return -1;
+	}
+	f->buf = tmp;
+	f->size = newsz;
+	return 0;
+}
+
+/* Appends a record to the frame being assembled for a protocol v2 client.
+ * Records other than responses are lost if they don't fit in the queue limit,
+ * and, while the client
+ * is stalled, motion replaces the previous motion record if nothing was added
+ * after it. Either way the loss is reported by a REC_DROP record.
+ */
+static int frame_add(struct client *c, int type, const void *data, int size, long long time, int motion)
+{
+	struct uframe *f = &c->cold->frame;
+	struct rec_hdr *rec;
+	int pos, recsz = (sizeof *rec + size + 7) & ~7;
+
+	if(motion && f->motion_pos && c->outq.stalled &&
+			((struct rec_hdr*)(f->buf + f->motion_pos))->size == recsz) {
+		pos = f->motion_pos;
+		rec = (struct rec_hdr*)(f->buf + pos);
+		f->lost++;
+		f->lost_seq = rec->seq;
+		c->outq.overwritten++;
+	} else {
+		if(!f->count) {
+			f->len = sizeof(struct frame_hdr);
+		}
+		if((c->outq.limit > 0 && type != REC_RESPONSE &&
+					c->outq.count + f->len + recsz > c->outq.limit) ||
+				frame_reserve(f, recsz) == -1) {
+			if(!f->count) f->len = 0;
+			f->lost++;
+			f->lost_seq = f->seq++;
+			c->outq.dropped++;
+			return -1;
+		}
+		pos = f->len;
+		f->len += recsz;
+		f->count++;
+	}
+
+	rec = (struct rec_hdr*)(f->buf + pos);
+	rec->type = type;
+	rec->size = recsz;
+	rec->seq = f->seq++;
+	rec->time = time;
+	memcpy(rec + 1, data, size);
+	memset((char*)(rec + 1) + size, 0, recsz - sizeof *rec - size);
+
+	f->motion_pos = motion ? pos : 0;
+	return 0;
+}
+
+/* finishes the current frame, and moves it to the output queue */
+static void frame_close(struct client *c)
+{
+	struct uframe *f = &c->cold->frame;
+	struct frame_hdr *hdr;
+	uint32_t drop[2];
+
+	if(f->lost) {
+		drop[0] = f->lost;
+		drop[1] = f->lost_seq;
+		f->lost = 0;
+		frame_add(c, REC_DROP, drop, sizeof drop, get_usec(), 0);
+	}
+
+	/* records were already checked against the limit by frame_add */
+	hdr = (struct frame_hdr*)f->buf;
+	hdr->size = f->len;
+	hdr->count = f->count;
+	if(outq_push_nolimit(&c->outq, f->buf, f->len) == -1) {
+		f->lost += f->count;
+		f->lost_seq = f->seq - 1;
+		queue_full(c);
+	}
+	f->len = f->count = f->motion_pos = 0;
+}
+
+static int send_urec(struct client *c, int type, const void *data, int size, long long time, int motion)
+{
+	int res = 0;
+
+	fanout_lock(c);
+	if(c->dead) {
+		res = -1;
+		goto end;
+	}
+
+	c->outq.limit = cfg.client_queue_limit;
+	if(frame_add(c, type, data, size, time, motion) == -1) {
+		queue_full(c);
+		res = -1;
+		goto end;
+	}
+	if(cfg.client_flush == FLUSH_IMMEDIATE && !c->cold->in_requests) {
+		flush_uclient(c);
+	}
+	if(c->dead) res = -1;
+end:
+	fanout_unlock(c);
+	return res;
+}
+
+/* applies the mask and threshold of the axis a raw axis is mapped to, zeroing
+ * values below the threshold. Returns -1 if the axis is masked out.
+ */
+static int filter_raw_axis(struct client_filter *flt, int devaxis, int *val)
+{
+	int axis;
+
+	if((axis = dev_axis_mapping(devaxis)) == -1) {
+		/* not mapped to any axis, only passed if all axes are */
+		return (flt->axis_mask & FILTER_AXIS_MASK) == FILTER_AXIS_MASK ? 0 : -1;
+	}
+	if(!(flt->axis_mask & (1 << axis))) {
+		return -1;
+	}
+	if(abs(*val) < flt->thres[axis]) {
+		*val = 0;
+	}
+	return 0;
+}
+
+/* evaluates the client event filter (REQ_SET_FILTER), returns the data to
+ * send, which might be a filtered copy in buf, or null to skip the event.
+ */
+static const int32_t *filter_uevent(struct client *c, const int32_t *data, int32_t *buf)
+{
+	int i, val, delta, maxdelta = 0, moving = 0, was_moving = 0;
+	struct client_filter *flt = &c->cold->filter;
+
+	switch(data[0]) {
+	case UEV_PRESS:
+	case UEV_RELEASE:
+	case UEV_RAWBUTTON:
+		if(data[1] < 0 || data[1] >= 64) break;
+		return flt->bn_mask[data[1] >> 5] & (1u << (data[1] & 31)) ? data : 0;
+
+	case UEV_MOTION:
+	case UEV_MOTION_ACCUM:
+		memcpy(buf, data, 8 * sizeof *buf);
+		for(i=0; i<6; i++) {
+			if(!(flt->axis_mask & (1 << i)) || abs(buf[i + 1]) < flt->thres[i]) {
+				buf[i + 1] = 0;
+			}
+			if(buf[i + 1]) moving = 1;
+			if(flt->last[i]) was_moving = 1;
+			if((delta = abs(buf[i + 1] - flt->last[i])) > maxdelta) {
+				maxdelta = delta;
+			}
+		}
+		if(!moving && !was_moving) return 0;
+		/* accumulated motion is relative, the change threshold doesn't apply */
+		if(moving && data[0] == UEV_MOTION && maxdelta < flt->min_delta) {
+			return 0;
+		}
+		memcpy(flt->last, buf + 1, sizeof flt->last);
+		return buf;
+
+	case UEV_RAWAXIS:
+		val = data[2];
+		if(filter_raw_axis(flt, data[1], &val) == -1) {
+			return 0;
+		}
+		if(val == data[2]) return data;
+		memcpy(buf, data, 8 * sizeof *buf);
+		buf[2] = val;
+		return buf;
+
+	case UEV_RAWFRAME:
+		/* masked out axes are left in the frame, as 0 */
+		memcpy(buf, data, 8 * sizeof *buf);
+		for(i=0; i<RAWFRAME_AXES; i++) {
+			val = (int16_t)(buf[4 + i / 2] >> (i & 1 ? 16 : 0));
+			if(filter_raw_axis(flt, i, &val) == -1) {
+				val = 0;
+			}
+			if(i & 1) {
+				buf[4 + i / 2] = (buf[4 + i / 2] & 0xffff) | ((uint32_t)(uint16_t)val << 16);
+			} else {
+				buf[4 + i / 2] = (buf[4 + i / 2] & 0xffff0000) | (uint16_t)val;
+			}
+		}
+		return buf;
+
+	default:
+		break;
+	}
+	return data;
+}
+
+/* compact event encoding (EVENC_COMPACT), returns the encoded size */
+static int encode_compact(unsigned char *buf, const int32_t *data)
+{
+	int i, size = 2;
+	uint32_t zz;
+
+	buf[0] = data[0];
+	buf[1] = 0;
+	for(i=0; i<7; i++) {
+		if(!data[i + 1]) continue;
+
+		buf[1] |= 1 << i;
+		zz = ((uint32_t)data[i + 1] << 1) ^ (uint32_t)(data[i + 1] >> 31);
+		while(zz >= 0x80) {
+			buf[size++] = (zz & 0x7f) | 0x80;
+			zz >>= 7;
+		}
+		buf[size++] = zz;
+	}
+	return size;
+}
+
+static int send_uevcompact(struct client *c, const int32_t *data, long long time, int motion)
+{
+	int size;
+	unsigned char buf[CEV_MAX_SIZE];
+
+	size = encode_compact(buf, data);
+
+	if(c->proto < 2) {
+		if(motion) {
+			return send_umotion(c, buf, size);
+		}
+		return send_umsg(c, buf, size);
+	}
+	return send_urec(c, buf[0], buf + 1, size - 1, time, motion);
+}
+
+int send_uevmsg(struct client *c, const int32_t *data, long long time)
+{
+	int32_t buf[8];
+
+	if(c->filter_on && !(data = filter_uevent(c, data, buf))) {
+		return 0;
+	}
+	counter_inc(&c->num_events);
+	metric_inc(MET_EVENTS);
+	if(c->evenc == EVENC_COMPACT) {
+		return send_uevcompact(c, data, time, 0);
+	}
+	if(c->proto < 2) {
+		return send_umsg(c, data, 8 * sizeof *data);
+	}
+	return send_urec(c, data[0], data + 1, 7 * sizeof *data, time, 0);
+}
+
+int send_uevmotion(struct client *c, const int32_t *data, long long time)
+{
+	int32_t buf[8];
+
+	if(c->filter_on && !(data = filter_uevent(c, data, buf))) {
+		return 0;
+	}
+	counter_inc(&c->num_events);
+	metric_inc(MET_EVENTS);
+	if(c->evenc == EVENC_COMPACT) {
+		return send_uevcompact(c, data, time, 1);
+	}
+	if(c->proto < 2) {
+		return send_umotion(c, data, 8 * sizeof *data);
+	}
+	return send_urec(c, data[0], data + 1, 7 * sizeof *data, time, 1);
+}
+
+static int send_uresp(struct client *c, struct reqresp *rr)
+{
+	unsigned char buf[sizeof *rr + 1];
+
+	if(c->proto < 2) {
+		if(c->evenc == EVENC_COMPACT) {
+			buf[0] = CEV_RESPONSE;
+			memcpy(buf + 1, rr, sizeof *rr);
+			return queue_umsg(c, buf, sizeof buf, 1);
+		}
+		return queue_umsg(c, rr, sizeof *rr, 1);
+	}
+	return send_urec(c, REC_RESPONSE, rr, sizeof *rr, get_usec(), 0);
+}
+
+int uclient_pending(struct client *c)
+{
+	return outq_pending(&c->outq) + c->cold->frame.len;
+}
+
+/* mark a client for disconnection at the end of the loop iteration */
+static void drop_client(struct client *c)
+{
+	fanout_lock(c);
+	c->dead = 1;
+	fanout_unlock(c);
+}
+
+int uevents_wpending(fd_set *wset)
+{
+	int s, max_fd = -1;
+	struct client *c = first_client();
+
+	while(c) {
+		if(get_client_type(c) == CLIENT_UNIX) {
+			fanout_lock(c);
+			/* held back requests are resumed after the next flush */
+			if(uclient_pending(c) || c->cold->req_held) {
+				s = get_client_socket(c);
+				FD_SET(s, wset);
+				if(s > max_fd) max_fd = s;
+			}
+			fanout_unlock(c);
+		}
+		c = next_client(c);
+	}
+	return max_fd;
+}
+
+void flush_uevents(void)
+{
+	int s, dead;
+	struct client *citer, *c;
+
+	shm_ring_wake();
+
+	citer = first_client();
+	while(citer) {
+		c = citer;
+		citer = next_client(c);
+
+		if(get_client_type(c) != CLIENT_UNIX) continue;
+
+		fanout_lock(c);
+		if(!c->dead && uclient_pending(c)) {
+			flush_uclient(c);
+		}
+		dead = c->dead;
+		fanout_unlock(c);
+
+		/* uevents_wpending keeps held back clients in the write set, so this
+		 * is retried as soon as the client reads some of its output.
+		 */
+		if(!dead && c->cold->req_held) {
+			resume_requests(c);
+			dead = c->dead;
+		}
+
+		if(dead) {
+			/* remove before closing, so that no fan-out worker can write to
+			 * a reused socket descriptor.
+			 */
+			s = get_client_socket(c);
+			uid_count_dec(c->cold->uid);
+			remove_client(c);
+			close(s);
+		}
+	}
+}
+
+static struct uid_count *find_uid_count(uid_t uid)
+{
+	int i;
+	for(i=0; i<num_uid_counts; i++) {
+		if(uid_counts[i].uid == uid) {
+			return uid_counts + i;
+		}
+	}
+	return 0;
+}
+
+static int uid_count_inc(uid_t uid)
+{
+	struct uid_count *uc, *tmp;
+	int newsz;
+
+	if(!(uc = find_uid_count(uid))) {
+		if(num_uid_counts >= max_uid_counts) {
+			newsz = max_uid_counts ? max_uid_counts * 2 : 16;
+			if(!(tmp = realloc(uid_counts, newsz * sizeof *uid_counts))) {
+				return -1;
+			}
+			uid_counts = tmp;
+			max_uid_counts = newsz;
+		}
+		uc = uid_counts + num_uid_counts++;
+		uc->uid = uid;
+		uc->count = 0;
+	}
+
+	if(cfg.max_clients_per_user > 0 && uc->count >= cfg.max_clients_per_user) {
+		return -1;
+	}
+	uc->count++;
+	return 0;
+}
+
+static void uid_count_dec(uid_t uid)
+{
+	struct uid_count *uc;
+
+	if(!(uc = find_uid_count(uid))) return;
+
+	if(--uc->count <= 0) {
+		*uc = uid_counts[--num_uid_counts];
+	}
+}
+
+/* returns the user id of the peer, or -1 if we can't find out */
+static uid_t peer_uid(int s)
+{
+#if defined(SO_PEERCRED)
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+
+	if(getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &len) != -1) {
+		return cred.uid;
+	}
+#elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
+	uid_t uid;
+	gid_t gid;
+
+	if(getpeereid(s, &uid, &gid) != -1) {
+		return uid;
+	}
+#endif
+	return (uid_t)-1;
+}
+
+static void accept_clients(void)
+{
+	int s;
+	uid_t uid;
+	struct client *c;
+
+	for(;;) {
+#ifdef SOCK_NONBLOCK
+		while((s = accept4(lsock, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1 && errno == EINTR);
+#else
+		while((s = accept(lsock, 0, 0)) == -1 && errno == EINTR);
+		if(s >= 0) {
+			fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+			fcntl(s, F_SETFD, FD_CLOEXEC);
+		}
+#endif
+		if(s == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				logmsg(LOG_ERR, "error while accepting connection on the UNIX socket: %s\n", strerror(errno));
+			}
+			break;
+		}
+
+		uid = peer_uid(s);
+		if(uid_count_inc(uid) == -1) {
+			logmsg(LOG_WARNING, "rejecting connection from uid %d: too many clients\n", (int)uid);
+			close(s);
+			continue;
+		}
+
+		if(!(c = add_client(CLIENT_UNIX, &s))) {
+			logmsg(LOG_ERR, "failed to add client: %s\n", strerror(errno));
+			uid_count_dec(uid);
+			close(s);
+			continue;
+		}
+		c->cold->uid = uid;
+		metric_inc(MET_CLIENTS_ACCEPTED);
+	}
+}
+
+int handle_uevents(fd_set *rset)
+{
+	struct client *citer;
+
+	if(lsock == -1) {
+		return -1;
+	}
+
+	if(FD_ISSET(lsock, rset)) {
+		accept_clients();
+	}
+
+	/* all the UNIX socket clients */
+	citer = first_client();
+	while(citer) {
+		struct client *c = citer;
+		citer = next_client(c);
+
+		if(get_client_type(c) == CLIENT_UNIX && !c->dead) {
+			int s = get_client_socket(c);
+
+			if(FD_ISSET(s, rset)) {
+				int rdbytes;
+				int32_t msg;
+				float sens;
+
+				/* handle client requests */
+				switch(c->proto) {
+				case 0:
+					while((rdbytes = read(s, &msg, sizeof msg)) < 0 && errno == EINTR);
+					if(rdbytes <= 0) {	/* something went wrong... disconnect client */
+						drop_client(c);
+						continue;
+					}
+
+					/* handle magic NaN protocol change requests */
+					if((msg & 0xffffff00) == (REQ_TAG | REQ_CHANGE_PROTO)) {
+						c->proto = msg & 0xff;
+
+						/* if the client requests a protocol version higher than the
+						 * daemon supports, return the maximum supported version and
+						 * switch to that.
+						 */
+						if(c->proto > MAX_PROTO_VER) {
+							c->proto = MAX_PROTO_VER;
+							msg = REQ_TAG | REQ_CHANGE_PROTO | MAX_PROTO_VER;
+						}
+						send_umsg(c, &msg, sizeof msg);
+
+						if(c->proto > 0) {
+							/* set default event mask for proto-v1 clients */
+							set_client_evmask(c, EVMASK_MOTION | EVMASK_BUTTON | EVMASK_DEV);
+						}
+						continue;
+					}
+
+					/* protocol v0: only sensitivity comes from clients */
+					sens = *(float*)&msg;
+					if(isfinite(sens)) {
+						set_client_sensitivity(c, sens);
+					}
+					break;
+
+				case 1:
+				case 2:
+					/* protocol v1/v2: process all requests received so far */
+					if(read_requests(c) == -1) {
+						drop_client(c);
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/* Reads as many requests as are available, up to MAX_REQ_READS buffers
+ * full, and handles all complete ones. Responses are written out together
+ * after the whole batch, even with immediate flushing. Requests are held back
+ * in the request buffer, and the socket isn't read any further, while more
+ * than half of the queue limit is waiting for the client (see requests_held).
+ */
+#define MAX_REQ_READS	8
+
+static int is_str_request(int req)
+{
+	switch(req & 0xffff) {
+	case REQ_SET_NAME:
+	case REQ_SCFG_SERDEV:
+	case REQ_SCFG_BATCH:
+		return 1;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/* long strings are read directly into the client string buffer, which is
+ * only reallocated when it's too small, then the request is handled as if
+ * the whole string had arrived with it.
+ */
+static int begin_longstr(struct client *c, struct reqresp *req)
+{
+	int len, padlen;
+	char *tmp;
+	struct reqresp_strbuf *sbuf = &c->cold->strbuf;
+
+	len = REQSTR_REMLEN(req);
+	padlen = REQSTR_PADLEN(len);
+
+	if(!sbuf->buf || sbuf->size < padlen + 1) {
+		if(!(tmp = realloc(sbuf->buf, padlen + 1))) {
+			logmsg(LOG_ERR, "client %s: failed to allocate %d byte string buffer\n",
+					get_client_name(c), padlen + 1);
+			return -1;
+		}
+		sbuf->buf = tmp;
+		sbuf->size = padlen + 1;
+	}
+	sbuf->endp = sbuf->buf;
+	sbuf->expect = 0;
+
+	c->cold->strreq = *req;
+	c->cold->strpend = padlen;
+	if(!padlen) {
+		return end_longstr(c);
+	}
+	return 0;
+}
+
+static int end_longstr(struct client *c)
+{
+	struct reqresp_strbuf *sbuf = &c->cold->strbuf;
+
+	sbuf->endp = sbuf->buf + REQSTR_REMLEN(&c->cold->strreq);
+	*sbuf->endp = 0;
+	return handle_request(c, &c->cold->strreq);
+}
+
+/* string reception for requests which take strings, complete long strings
+ * are already in the client string buffer.
+ */
+static int recv_str(struct client *c, struct reqresp *req)
+{
+	if(REQSTR_LONG(req)) {
+		return 1;
+	}
+	return spnav_recv_str(&c->cold->strbuf, req);
+}
+
+/* Backpressure for pipelined requests: once the output waiting for the client
+ * passes half the queue limit, try to write it out, and if that doesn't help,
+ * stop handling requests until flush_uevents finds the client caught up.
+ */
+static int requests_held(struct client *c)
+{
+	int pending;
+
+	fanout_lock(c);
+	if((pending = uclient_pending(c)) > cfg.client_queue_limit / 2) {
+		flush_uclient(c);
+		pending = uclient_pending(c);
+	}
+	fanout_unlock(c);
+
+	c->cold->req_held = pending > cfg.client_queue_limit / 2;
+	return c->cold->req_held;
+}
+
+/* handles the complete requests in the request buffer */
+static int process_requests(struct client *c)
+{
+	int pos = 0, len, res = 0;
+	struct client_cold *cold = c->cold;
+	struct reqresp req;
+
+	while(!c->dead) {
+		if(cold->strpend > 0) {
+			/* long string payload, straight into the string buffer */
+			if(!(len = cold->reqbytes - pos)) break;
+			if(len > cold->strpend) len = cold->strpend;
+			memcpy(cold->strbuf.endp, cold->reqbuf + pos, len);
+			cold->strbuf.endp += len;
+			cold->strpend -= len;
+			pos += len;
+			if(cold->strpend > 0) break;
+
+			if(requests_held(c)) break;
+			if(end_longstr(c) == -1) {
+				res = -1;
+				break;
+			}
+			continue;
+		}
+
+		if(cold->reqbytes - pos < sizeof req) break;
+		if(requests_held(c)) break;
+
+		memcpy(&req, cold->reqbuf + pos, sizeof req);
+		pos += sizeof req;
+
+		if(REQSTR_LONG(&req) && is_str_request(req.type)) {
+			res = begin_longstr(c, &req);
+		} else {
+			res = handle_request(c, &req);
+		}
+		if(res == -1) break;
+	}
+	/* keep any partial or held back requests for later */
+	cold->reqbytes -= pos;
+	if(cold->reqbytes > 0) {
+		memmove(cold->reqbuf, cold->reqbuf + pos, cold->reqbytes);
+	}
+	return res;
+}
+
+static int read_requests(struct client *c)
+{
+	int i, rdbytes, space, res = 0;
+	struct client_cold *cold = c->cold;
+
+	cold->in_requests = 1;
+
+	for(i=0; i<MAX_REQ_READS && !cold->req_held; i++) {
+		space = sizeof cold->reqbuf - cold->reqbytes;
+		while((rdbytes = read(c->sock, cold->reqbuf + cold->reqbytes, space)) < 0 && errno == EINTR);
+		if(rdbytes <= 0) {
+			if(rdbytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				res = -1;
+			}
+			break;
+		}
+		cold->reqbytes += rdbytes;
+
+		if((res = process_requests(c)) == -1 || c->dead || rdbytes < space) break;
+	}
+
+	cold->in_requests = 0;
+	if(cfg.client_flush == FLUSH_IMMEDIATE && !c->dead) {
+		fanout_lock(c);
+		flush_uclient(c);
+		fanout_unlock(c);
+	}
+	return res;
+}
+
+/* resumes the requests held back by requests_held, if the client caught up */
+static void resume_requests(struct client *c)
+{
+	c->cold->in_requests = 1;
+	if(process_requests(c) == -1) {
+		drop_client(c);
+	}
+	c->cold->in_requests = 0;
+
+	if(cfg.client_flush == FLUSH_IMMEDIATE && !c->dead) {
+		fanout_lock(c);
+		flush_uclient(c);
+		fanout_unlock(c);
+	}
+}
+
+int uclient_reading(struct client *c)
+{
+	return !c->cold->req_held;
+}
+
+static int sendresp(struct client *c, struct reqresp *rr, int status)
+{
+	rr->data[6] = status;
+	return send_uresp(c, rr);
+}
+
+/* Responses carrying file descriptors bypass the output queue, because the
+ * descriptors have to go out along with the response bytes. Fails if older
+ * output for the client can't be written first.
+ */
+static int sendresp_fds(struct client *c, struct reqresp *rr, int *fds, int nfds)
+{
+	int wr, res = -1;
+	struct uframe *f = &c->cold->frame;
+	struct frame_hdr *hdr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(4 * sizeof(int))];
+	unsigned char tagged[sizeof *rr + 1];
+
+	rr->data[6] = 0;
+
+	fanout_lock(c);
+	flush_uclient(c);
+	if(c->dead || uclient_pending(c)) {
+		goto end;
+	}
+
+	if(c->proto >= 2) {
+		if(frame_add(c, REC_RESPONSE, rr, sizeof *rr, get_usec(), 0) == -1) {
+			goto end;
+		}
+		hdr = (struct frame_hdr*)f->buf;
+		hdr->size = f->len;
+		hdr->count = f->count;
+		iov.iov_base = f->buf;
+		iov.iov_len = f->len;
+	} else if(c->evenc == EVENC_COMPACT) {
+		tagged[0] = CEV_RESPONSE;
+		memcpy(tagged + 1, rr, sizeof *rr);
+		iov.iov_base = tagged;
+		iov.iov_len = sizeof tagged;
+	} else {
+		iov.iov_base = rr;
+		iov.iov_len = sizeof *rr;
+	}
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	while((wr = sendmsg(get_client_socket(c), &msg, MSG_DONTWAIT)) == -1 && errno == EINTR);
+	if(wr > 0) {
+		/* the descriptors went out with the first byte, queue the rest */
+		if(wr < iov.iov_len) {
+			outq_push_nolimit(&c->outq, (char*)iov.iov_base + wr, iov.iov_len - wr);
+		}
+		res = 0;
+	} else if(c->proto >= 2) {
+		f->lost += f->count;
+		f->lost_seq = f->seq - 1;
+	}
+	f->len = f->count = f->motion_pos = 0;
+end:
+	fanout_unlock(c);
+	return res;
+}
+
+/* single response followed by the padded string, for STRMODE_LONG clients */
+static int sendbuf_long(struct client *c, int req, const void *data, int len)
+{
+	int size;
+	struct reqresp *rr;
+	static unsigned char *buf;
+	static int buf_size;
+
+	size = sizeof *rr + REQSTR_PADLEN(len) + 1;
+	if(size > buf_size) {
+		void *tmp = realloc(buf, size);
+		if(!tmp) {
+			logmsg(LOG_ERR, "failed to allocate %d byte response buffer\n", size);
+			return -1;
+		}
+		buf = tmp;
+		buf_size = size;
+	}
+	memset(buf, 0, size);
+
+	/* leave room for the tag byte of the compact encoding in front */
+	rr = (struct reqresp*)(buf + 1);
+	rr->type = req;
+	rr->data[6] = len | REQSTR_LONG_BIT;
+	if(len) {
+		memcpy(rr + 1, data, len);
+	}
+
+	if(c->proto < 2) {
+		if(c->evenc == EVENC_COMPACT) {
+			buf[0] = CEV_RESPONSE;
+			return queue_umsg(c, buf, size, 1);
+		}
+		return queue_umsg(c, buf + 1, size - 1, 1);
+	}
+	return send_urec(c, REC_RESPONSE, buf + 1, size - 1, get_usec(), 0);
+}
+
+/* longest string sent as a single response. The record size of protocol v2 is
+ * 16 bits, and has to fit the record header, the response, and the padding.
+ */
+static int longstr_max(struct client *c)
+{
+	if(c->proto >= 2) {
+		return (0xffff - sizeof(struct rec_hdr) - sizeof(struct reqresp)) & ~31;
+	}
+	return REQSTR_MAX_LEN;
+}
+
+/* sends a string or buffer, as a single response if the client selected
+ * STRMODE_LONG and it's short enough, in chunks otherwise.
+ */
+static int sendbuf(struct client *c, int req, const void *data, int len)
+{
+	struct reqresp rr = {0};
+	const char *ptr = data;
+
+	if(c->cold->strmode == STRMODE_LONG && len <= longstr_max(c)) {
+		return sendbuf_long(c, req, data, len);
+	}
+
+	rr.type = req;
+	rr.data[6] = len;
+
+	do {
+		if(ptr) {
+			memcpy(rr.data, ptr, len > REQSTR_CHUNK_SIZE ? REQSTR_CHUNK_SIZE : len);
+		}
+		if(send_uresp(c, &rr) == -1) {
+			return -1;
+		}
+		ptr += REQSTR_CHUNK_SIZE;
+		len -= REQSTR_CHUNK_SIZE;
+		rr.data[6] = len | REQSTR_CONT_BIT;
+	} while(len > 0);
+
+	return 0;
+}
+
+static int sendstr(struct client *c, int req, const char *str)
+{
+	return sendbuf(c, req, str, str ? strlen(str) : 0);
+}
+
+#define AXIS_VALID(x)	((x) >= 0 && (x) < MAX_AXES)
+#define BN_VALID(x)		((x) >= 0 && (x) < MAX_BUTTONS)
+#define BNACT_VALID(x)	((x) >= 0 && (x) < MAX_BNACT)
+
+static int check_cfg_tuple(struct cfg_tuple *t)
+{
+	switch(t->key) {
+	case REQ_SCFG_SENS:
+		return isfinite(*(float*)&t->val) ? 0 : -1;
+
+	case REQ_SCFG_SENS_AXIS:
+		if(t->idx < 0 || t->idx >= 6) return -1;
+		return isfinite(*(float*)&t->val) ? 0 : -1;
+
+	case REQ_SCFG_DEADZONE:
+	case REQ_SCFG_INVERT:
+		return AXIS_VALID(t->idx) ? 0 : -1;
+
+	case REQ_SCFG_AXISMAP:
+		return AXIS_VALID(t->idx) && t->val >= -1 && t->val < 6 ? 0 : -1;
+
+	case REQ_SCFG_BNMAP:
+		return BN_VALID(t->idx) && BN_VALID(t->val) ? 0 : -1;
+
+	case REQ_SCFG_BNACTION:
+		return BN_VALID(t->idx) && BNACT_VALID(t->val) ? 0 : -1;
+
+	case REQ_SCFG_KBMAP:
+#ifdef USE_X11
+		if(!BN_VALID(t->idx)) return -1;
+		return t->val <= 0 || kbemu_keyname(t->val) ? 0 : -1;
+#else
+		return -1;
+#endif
+
+	case REQ_SCFG_LED:
+		return t->val >= 0 && t->val < 3 ? 0 : -1;
+
+	case REQ_SCFG_SWAPYZ:
+	case REQ_SCFG_GRAB:
+	case REQ_SCFG_REPEAT:
+		return 0;
+
+	default:
+		break;
+	}
+	return -1;
+}
+
+/* only called for tuples which passed check_cfg_tuple */
+static void apply_cfg_tuple(struct cfg_tuple *t)
+{
+	float fval = *(float*)&t->val;
 
-		data[0] = UEV_MOTION;
+	switch(t->key) {
+	case REQ_SCFG_SENS:
+		cfg.sensitivity = fval;
+		break;
 
-		motion_mul = get_client_sensitivity(c);
-		for(i=0; i<6; i++) {
-			float val = (float)ev->motion.data[i] * motion_mul;
-			data[i + 1] = (int32_t)val;
+	case REQ_SCFG_SENS_AXIS:
+		if(t->idx < 3) {
+			cfg.sens_trans[t->idx] = fval;
+		} else {
+			cfg.sens_rot[t->idx - 3] = fval;
 		}
-		data[7] = ev->motion.period;
 		break;
 
-	case EVENT_RAWAXIS:
-		if(!(c->evmask & EVMASK_RAWAXIS)) return;
-
-		data[0] = UEV_RAWAXIS;
-		data[1] = ev->axis.idx;
-		data[2] = ev->axis.value;
+	case REQ_SCFG_DEADZONE:
+		cfg.dead_threshold[t->idx] = t->val;
 		break;
 
-	case EVENT_BUTTON:
-		if(!(c->evmask & EVMASK_BUTTON)) return;
+	case REQ_SCFG_INVERT:
+		cfg.invert[t->idx] = t->val ? 1 : 0;
+		break;
 
-		data[0] = ev->button.press ? UEV_PRESS : UEV_RELEASE;
-		data[1] = ev->button.bnum;
-		data[2] = ev->button.press;
+	case REQ_SCFG_AXISMAP:
+		cfg.map_axis[t->idx] = t->val;
 		break;
 
-	case EVENT_RAWBUTTON:
-		if(!(c->evmask & EVMASK_RAWBUTTON)) return;
+	case REQ_SCFG_BNMAP:
+		cfg.map_button[t->idx] = t->val;
+		break;
 
-		data[0] = UEV_RAWBUTTON;
-		data[1] = ev->button.bnum;
-		data[2] = ev->button.press;
+	case REQ_SCFG_BNACTION:
+		cfg.bnact[t->idx] = t->val;
 		break;
 
-	case EVENT_DEV:
-		if(!(c->evmask & EVMASK_DEV)) return;
+#ifdef USE_X11
+	case REQ_SCFG_KBMAP:
+		cfg.kbmap[t->idx][0] = t->val;
+		cfg.kbmap_count[t->idx] = t->val > 0 ? 1 : 0;
+		free(cfg.kbmap_str[t->idx]);
+		cfg.kbmap_str[t->idx] = t->val > 0 ? strdup(kbemu_keyname(t->val)) : 0;
+		break;
+#endif
 
-		data[0] = UEV_DEV;
-		data[1] = ev->dev.op;
-		data[2] = ev->dev.id;
-		data[3] = ev->dev.devtype;
-		data[4] = ev->dev.usbid[0];
-		data[5] = ev->dev.usbid[1];
+	case REQ_SCFG_LED:
+		cfg.led = t->val;
 		break;
 
-	case EVENT_CFG:
-		if(!(c->evmask & EVMASK_CFG)) return;
+	case REQ_SCFG_SWAPYZ:
+		cfg.swapyz = t->val ? 1 : 0;
+		break;
 
-		data[0] = UEV_CFG;
-		data[1] = ev->cfg.cfg;
-		memcpy(data + 2, ev->cfg.data, sizeof ev->cfg.data);
+	case REQ_SCFG_GRAB:
+		cfg.grab_device = t->val ? 1 : 0;
 		break;
 
-	default:
-		return;
+	case REQ_SCFG_REPEAT:
+		cfg.repeat_msec = t->val;
+		break;
 	}
-
-	while(write(get_client_socket(c), data, sizeof data) == -1 && errno == EINTR);
 }
 
-int handle_uevents(fd_set *rset)
+/* validate the whole batch first, so that it's either applied in full or
+ * not at all, and the event pipeline never sees it half-way through.
+ * R[0] is the index of the offending tuple on failure.
+ */
+static int set_cfg_batch(struct client *c, struct reqresp *req)
 {
-	struct client *citer;
-	struct reqresp *req;
+	int i, len, count;
+	struct cfg_tuple *tup;
 
-	if(lsock == -1) {
+	memset(req->data, 0, sizeof req->data);
+	req->data[0] = -1;
+
+	len = c->cold->strbuf.endp - c->cold->strbuf.buf;
+	count = len / sizeof *tup;
+	if(len % sizeof *tup || count > CFG_BATCH_MAX) {
+		logmsg(LOG_WARNING, "client %s: invalid config batch size: %d bytes\n", get_client_name(c), len);
 		return -1;
 	}
-
-	if(FD_ISSET(lsock, rset)) {
-		/* got an incoming connection */
-		int s;
-
-		if((s = accept(lsock, 0, 0)) == -1) {
-			logmsg(LOG_ERR, "error while accepting connection on the UNIX socket: %s\n", strerror(errno));
-		} else {
-			/* set socket as non-blocking and add client to the list */
-			fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
-
-			if(!add_client(CLIENT_UNIX, &s)) {
-				logmsg(LOG_ERR, "failed to add client: %s\n", strerror(errno));
-			}
+	tup = (struct cfg_tuple*)c->cold->strbuf.buf;
+
+	for(i=0; i<count; i++) {
+		if(check_cfg_tuple(tup + i) == -1) {
+			logmsg(LOG_WARNING, "client %s: invalid config batch entry %d: %s [%d] = %x\n",
+					get_client_name(c), i, reqstr(tup[i].key), tup[i].idx, (unsigned int)tup[i].val);
+			req->data[0] = i;
+			return -1;
 		}
 	}
+	if(!count) return 0;
 
-	/* all the UNIX socket clients */
-	citer = first_client();
-	while(citer) {
-		struct client *c = citer;
-		citer = next_client();
-
-		if(get_client_type(c) == CLIENT_UNIX) {
-			int s = get_client_socket(c);
-
-			if(FD_ISSET(s, rset)) {
-				int rdbytes;
-				int32_t msg;
-				float sens;
-
-				/* handle client requests */
-				switch(c->proto) {
-				case 0:
-					while((rdbytes = read(s, &msg, sizeof msg)) < 0 && errno == EINTR);
-					if(rdbytes <= 0) {	/* something went wrong... disconnect client */
-						close(get_client_socket(c));
-						remove_client(c);
-						continue;
-					}
-
-					/* handle magic NaN protocol change requests */
-					if((msg & 0xffffff00) == (REQ_TAG | REQ_CHANGE_PROTO)) {
-						c->proto = msg & 0xff;
-
-						/* if the client requests a protocol version higher than the
-						 * daemon supports, return the maximum supported version and
-						 * switch to that.
-						 */
-						if(c->proto > MAX_PROTO_VER) {
-							c->proto = MAX_PROTO_VER;
-							msg = REQ_TAG | REQ_CHANGE_PROTO | MAX_PROTO_VER;
-						}
-						write(s, &msg, sizeof msg);
+	for(i=0; i<count; i++) {
+		apply_cfg_tuple(tup + i);
+	}
+	cfg_changed();
+	broadcast_cfg_event(REQ_SCFG_BATCH, count);
+	return 0;
+}
 
-						if(c->proto > 0) {
-							/* set default event mask for proto-v1 clients */
-							c->evmask = EVMASK_MOTION | EVMASK_BUTTON | EVMASK_DEV;
-						}
-						continue;
-					}
+#define PUT_TUPLE(k, i, v) \
+	do { \
+		ptr->key = (k); \
+		ptr->idx = (i); \
+		ptr->val = (v); \
+		ptr++; \
+	} while(0)
 
-					/* protocol v0: only sensitivity comes from clients */
-					sens = *(float*)&msg;
-					if(isfinite(sens)) {
-						set_client_sensitivity(c, sens);
-					}
-					break;
+static int get_cfg_batch(struct client *c, int req)
+{
+	int i;
+	static struct cfg_tuple tup[CFG_BATCH_MAX];
+	struct cfg_tuple *ptr = tup;
 
-				case 1:
-					/* protocol v1: accumulate request bytes, and process */
-					while((rdbytes = read(s, c->reqbuf + c->reqbytes, sizeof *req - c->reqbytes)) < 0 && errno == EINTR);
-					if(rdbytes <= 0) {
-						close(s);
-						remove_client(c);
-						continue;
-					}
-					c->reqbytes += rdbytes;
-					if(c->reqbytes >= sizeof *req) {
-						req = (struct reqresp*)c->reqbuf;
-						c->reqbytes = 0;
-						if(handle_request(c, req) == -1) {
-							close(s);
-							remove_client(c);
-						}
-					}
-					break;
-				}
-			}
-		}
+	PUT_TUPLE(REQ_SCFG_SENS, 0, *(int*)&cfg.sensitivity);
+	for(i=0; i<3; i++) {
+		PUT_TUPLE(REQ_SCFG_SENS_AXIS, i, *(int*)(cfg.sens_trans + i));
+	}
+	for(i=0; i<3; i++) {
+		PUT_TUPLE(REQ_SCFG_SENS_AXIS, i + 3, *(int*)(cfg.sens_rot + i));
+	}
+	for(i=0; i<MAX_AXES; i++) {
+		PUT_TUPLE(REQ_SCFG_DEADZONE, i, cfg.dead_threshold[i]);
+		PUT_TUPLE(REQ_SCFG_INVERT, i, cfg.invert[i]);
+		PUT_TUPLE(REQ_SCFG_AXISMAP, i, cfg.map_axis[i]);
+	}
+	for(i=0; i<MAX_BUTTONS; i++) {
+		PUT_TUPLE(REQ_SCFG_BNMAP, i, cfg.map_button[i]);
+		PUT_TUPLE(REQ_SCFG_BNACTION, i, cfg.bnact[i]);
+#ifdef USE_X11
+		/* TODO handle multi-key sequences in a backwards compatible way */
+		PUT_TUPLE(REQ_SCFG_KBMAP, i, cfg.kbmap_count[i] > 0 ? cfg.kbmap[i][0] : 0);
+#endif
 	}
+	PUT_TUPLE(REQ_SCFG_SWAPYZ, 0, cfg.swapyz);
+	PUT_TUPLE(REQ_SCFG_LED, 0, cfg.led);
+	PUT_TUPLE(REQ_SCFG_GRAB, 0, cfg.grab_device);
+	PUT_TUPLE(REQ_SCFG_REPEAT, 0, cfg.repeat_msec);
 
-	return 0;
+	return sendbuf(c, req, tup, (ptr - tup) * sizeof *ptr);
 }
 
-static int sendresp(struct client *c, struct reqresp *rr, int status)
+/* Per-client event selection which the shared ring can't honour, because all
+ * ring clients read the same records. Returns what conflicts, or null.
+ */
+static const char *ring_conflict(struct client *c)
 {
-	rr->data[6] = status;
-	return write(get_client_socket(c), rr, sizeof *rr);
+	if(c->evmask & EVMASK_ACTIVE_ONLY) {
+		return "motion only while active";
+	}
+	if(get_active_client() == c && (get_active_flags() & ACTIVE_EXCLUSIVE)) {
+		return "an exclusive active claim";
+	}
+	if(c->subs && !c->sub_all) {
+		return "device subscriptions";
+	}
+	return 0;
 }
 
-#define AXIS_VALID(x)	((x) >= 0 && (x) < MAX_AXES)
-#define BN_VALID(x)		((x) >= 0 && (x) < MAX_BUTTONS)
-#define BNACT_VALID(x)	((x) >= 0 && (x) < MAX_BNACT)
-
 static int handle_request(struct client *c, struct reqresp *req)
 {
-	int i, idx, res;
+	int i, idx, res, fds[2];
 	float fval, fvec[6];
 	struct device *dev;
+	struct client_filter *flt;
 	const char *str = 0;
+	char *text;
+	int len;
 
 	logmsg(LOG_DEBUG, "request %s - %x %x %x %x %x %x\n", reqstr(req->type), req->data[0],
 			req->data[1], req->data[2], req->data[3], req->data[4], req->data[5], req->data[6]);
+	metric_request(req->type);
 
 	switch(req->type & 0xffff) {
 	case REQ_SET_NAME:
-		if((res = spnav_recv_str(&c->strbuf, req)) == -1) {
+		if((res = recv_str(c, req)) == -1) {
 			logmsg(LOG_ERR, "SET_NAME: failed to receive string\n");
 			break;
 		}
 		if(res) {
-			c->name = c->strbuf.buf;
-			c->strbuf.buf = 0;
-			logmsg(LOG_INFO, "client name: %s\n", c->name);
+			fanout_lock(c);
+			c->cold->name = c->cold->strbuf.buf;
+			c->cold->strbuf.buf = 0;
+			fanout_unlock(c);
+			logmsg(LOG_INFO, "client name: %s\n", c->cold->name);
 		}
 		break;
 
@@ -325,7 +1554,13 @@ static int handle_request(struct client *c, struct reqresp *req)
 		break;
 
 	case REQ_SET_EVMASK:
-		c->evmask = req->data[0];
+		if(c->ring && (req->data[0] & EVMASK_ACTIVE_ONLY)) {
+			logmsg(LOG_WARNING, "client %s: shared ring clients can't select motion only while active\n",
+					get_client_name(c));
+			sendresp(c, req, -1);
+			break;
+		}
+		set_client_evmask(c, req->data[0]);
 		sendresp(c, req, 0);
 		break;
 
@@ -334,9 +1569,184 @@ static int handle_request(struct client *c, struct reqresp *req)
 		sendresp(c, req, 0);
 		break;
 
+	case REQ_SET_DELIVERY:
+		/* the client moves between the main thread and its fan-out worker,
+		 * make sure no events for it are in flight.
+		 */
+		fanout_sync();
+		fanout_lock(c);
+		res = set_delivery_mode(c, req->data[0], req->data + 1);
+		fanout_unlock(c);
+		if(res == -1) {
+			logmsg(LOG_WARNING, "client attempted to set invalid delivery mode: %d\n", req->data[0]);
+			sendresp(c, req, -1);
+			break;
+		}
+		sendresp(c, req, 0);
+		break;
+
+	case REQ_SET_ACTIVE:
+		if(c->ring && req->data[0] && (req->data[1] & ACTIVE_EXCLUSIVE)) {
+			logmsg(LOG_WARNING, "client %s: shared ring clients can't claim exclusive active status\n",
+					get_client_name(c));
+			sendresp(c, req, -1);
+			break;
+		}
+		if(set_active_client(c, req->data[0], req->data[1]) == -1) {
+			if(verbose) {
+				logmsg(LOG_INFO, "client %s: active claim refused, %s holds an exclusive claim\n",
+						get_client_name(c), get_client_name(get_active_client()));
+			}
+			sendresp(c, req, -1);
+			break;
+		}
+		sendresp(c, req, 0);
+		break;
+
+	case REQ_GET_ACTIVE:
+		req->data[0] = get_active_client() == c;
+		req->data[1] = req->data[0] ? get_active_flags() : 0;
+		req->data[2] = get_active_client() != 0;
+		sendresp(c, req, 0);
+		break;
+
+	case REQ_SET_TRANSPORT:
+		if(req->data[0] == TRANSPORT_SHM_RING && (str = ring_conflict(c))) {
+			logmsg(LOG_WARNING, "client %s: can't use the shared ring with %s\n", get_client_name(c), str);
+			sendresp(c, req, -1);
+			break;
+		}
+		/* fan-out workers check the transport of their clients */
+		fanout_sync();
+		fanout_lock(c);
+		if(req->data[0] == TRANSPORT_SHM_RING) {
+			res = shm_ring_attach(c, fds);
+		} else if(req->data[0] == TRANSPORT_SOCKET) {
+			shm_ring_detach(c);
+			res = 0;
+		} else {
+			res = -1;
+		}
+		fanout_unlock(c);
+		if(res == -1) {
+			logmsg(LOG_WARNING, "client %s: failed to set transport: %d\n", get_client_name(c), req->data[0]);
+			sendresp(c, req, -1);
+			break;
+		}
+
+		if(c->ring) {
+			req->data[0] = shm_ring_slots();
+			req->data[1] = sizeof(struct shm_rec);
+			if(sendresp_fds(c, req, fds, 2) == -1) {
+				logmsg(LOG_WARNING, "client %s: failed to send the shared ring descriptors\n", get_client_name(c));
+				fanout_lock(c);
+				shm_ring_detach(c);
+				fanout_unlock(c);
+				sendresp(c, req, -1);
+			}
+		} else {
+			sendresp(c, req, 0);
+		}
+		break;
+
+	case REQ_SET_STRMODE:
+		if(req->data[0] != STRMODE_CHUNKED && req->data[0] != STRMODE_LONG) {
+			logmsg(LOG_WARNING, "client %s: invalid string mode: %d\n", get_client_name(c), req->data[0]);
+			sendresp(c, req, -1);
+			break;
+		}
+		c->cold->strmode = req->data[0];
+		req->data[0] = longstr_max(c);
+		sendresp(c, req, 0);
+		break;
+
+	case REQ_SET_EVENC:
+		if(req->data[0] != EVENC_DEFAULT && req->data[0] != EVENC_COMPACT) {
+			logmsg(LOG_WARNING, "client %s: invalid event encoding: %d\n", get_client_name(c), req->data[0]);
+			sendresp(c, req, -1);
+			break;
+		}
+		/* the response still goes out in the previous encoding */
+		sendresp(c, req, 0);
+		fanout_sync();
+		c->evenc = req->data[0];
+		break;
+
+	case REQ_SET_FILTER:
+		if(req->data[0] & ~(FILTER_AXIS_MASK | (0xffffu << FILTER_DELTA_SHIFT))) {
+			logmsg(LOG_WARNING, "client %s: invalid event filter axis mask: %x\n", get_client_name(c),
+					(unsigned int)req->data[0]);
+			sendresp(c, req, -1);
+			break;
+		}
+		/* fan-out workers filter the events of their clients */
+		fanout_sync();
+		flt = &c->cold->filter;
+		flt->axis_mask = req->data[0] & FILTER_AXIS_MASK;
+		flt->min_delta = (uint32_t)req->data[0] >> FILTER_DELTA_SHIFT;
+		flt->bn_mask[0] = req->data[1];
+		flt->bn_mask[1] = req->data[2];
+		c->filter_on = flt->axis_mask != FILTER_AXIS_MASK || flt->min_delta > 0 ||
+			flt->bn_mask[0] != 0xffffffff || flt->bn_mask[1] != 0xffffffff;
+		for(i=0; i<6; i++) {
+			flt->thres[i] = ((uint32_t)req->data[3 + i / 2] >> (i & 1) * 16) & 0xffff;
+			if(flt->thres[i]) c->filter_on = 1;
+		}
+		memset(flt->last, 0, sizeof flt->last);
+		sendresp(c, req, 0);
+		break;
+
+	case REQ_GET_FILTER:
+		if(!c->filter_on) {
+			req->data[0] = FILTER_AXIS_MASK;
+			req->data[1] = req->data[2] = 0xffffffff;
+			req->data[3] = req->data[4] = req->data[5] = 0;
+			sendresp(c, req, 0);
+			break;
+		}
+		flt = &c->cold->filter;
+		req->data[0] = flt->axis_mask | ((unsigned int)flt->min_delta << FILTER_DELTA_SHIFT);
+		req->data[1] = flt->bn_mask[0];
+		req->data[2] = flt->bn_mask[1];
+		for(i=0; i<3; i++) {
+			req->data[3 + i] = flt->thres[i * 2] | ((unsigned int)flt->thres[i * 2 + 1] << 16);
+		}
+		sendresp(c, req, 0);
+		break;
+
+	case REQ_GET_STATS:
+		if((len = metrics_text(&text, c)) == -1) {
+			sendresp(c, req, -1);
+			break;
+		}
+		/* cut off at the last complete line which fits, and say so */
+		if(len > REQSTR_MAX_LEN) {
+			len = REQSTR_MAX_LEN - sizeof STATS_TRUNC_MSG + 1;
+			while(len > 0 && text[len - 1] != '\n') len--;
+			memcpy(text + len, STATS_TRUNC_MSG, sizeof STATS_TRUNC_MSG - 1);
+			len += sizeof STATS_TRUNC_MSG - 1;
+			logmsg(LOG_WARNING, "stats text too long for a response, truncated\n");
+		}
+		sendbuf(c, req->type, text, len);
+		break;
+
+	case REQ_GET_DELIVERY:
+		req->data[0] = c->deliv_mode;
+		if(c->deliv_mode == DELIV_RESAMPLE) {
+			fval = 1000000.0f / (float)c->cold->deliv.period;
+			req->data[1] = *(int*)&fval;
+			req->data[2] = c->cold->deliv.phase;
+		} else if(c->deliv_mode == DELIV_RATELIMIT) {
+			req->data[1] = c->cold->deliv.interval;
+			req->data[2] = c->cold->deliv.policy;
+			req->data[3] = c->cold->deliv.saved;
+		}
+		sendresp(c, req, 0);
+		break;
+
 	case REQ_DEV_NAME:
 		if((dev = get_client_device(c))) {
-			spnav_send_str(get_client_socket(c), req->type, dev->name);
+			sendstr(c, req->type, dev->name);
 		} else {
 			sendresp(c, req, -1);
 		}
@@ -344,7 +1754,7 @@ static int handle_request(struct client *c, struct reqresp *req)
 
 	case REQ_DEV_PATH:
 		if((dev = get_client_device(c))) {
-			spnav_send_str(get_client_socket(c), req->type, dev->path);
+			sendstr(c, req->type, dev->path);
 		} else {
 			sendresp(c, req, -1);
 		}
@@ -387,6 +1797,46 @@ static int handle_request(struct client *c, struct reqresp *req)
 		}
 		break;
 
+	case REQ_DEV_SUBSCRIBE:
+		if(req->data[0] == -1) {
+			dev = 0;
+		} else if(!(dev = find_device(req->data[0]))) {
+			logmsg(LOG_WARNING, "client attempted to subscribe to invalid device: %d\n", req->data[0]);
+			sendresp(c, req, -1);
+			break;
+		}
+		if(c->ring && dev) {
+			logmsg(LOG_WARNING, "client %s: shared ring clients can't subscribe to specific devices\n",
+					get_client_name(c));
+			sendresp(c, req, -1);
+			break;
+		}
+		sendresp(c, req, client_subscribe_dev(c, dev));
+		break;
+
+	case REQ_DEV_UNSUBSCRIBE:
+		if(req->data[0] == -1) {
+			dev = 0;
+		} else if(!(dev = find_device(req->data[0]))) {
+			sendresp(c, req, -1);
+			break;
+		}
+		sendresp(c, req, client_unsubscribe_dev(c, dev));
+		break;
+
+	case REQ_DEV_STATE:
+		if(!(dev = get_client_device(c)) || (fds[0] = shm_devstate_fd(dev)) == -1) {
+			sendresp(c, req, -1);
+			break;
+		}
+		req->data[0] = dev->id;
+		req->data[1] = sizeof(struct shm_devstate);
+		if(sendresp_fds(c, req, fds, 1) == -1) {
+			logmsg(LOG_WARNING, "client %s: failed to send the device state descriptor\n", get_client_name(c));
+			sendresp(c, req, -1);
+		}
+		break;
+
 	case REQ_SCFG_SENS:
 		fval = *(float*)req->data;
 		if(isfinite(fval)) {
@@ -601,19 +2051,19 @@ static int handle_request(struct client *c, struct reqresp *req)
 		break;
 
 	case REQ_SCFG_SERDEV:
-		if((res = spnav_recv_str(&c->strbuf, req)) == -1) {
+		if((res = recv_str(c, req)) == -1) {
 			logmsg(LOG_ERR, "SCFG_SERDEV: failed to receive string\n");
 			break;
 		}
 		if(res) {
-			strncpy(cfg.serial_dev, c->strbuf.buf, sizeof cfg.serial_dev - 1);
+			strncpy(cfg.serial_dev, c->cold->strbuf.buf, sizeof cfg.serial_dev - 1);
 			cfg.serial_dev[sizeof cfg.serial_dev - 1] = 0;
 			cfg_changed();
 		}
 		break;
 
 	case REQ_GCFG_SERDEV:
-		spnav_send_str(c->sock, req->type, cfg.serial_dev);
+		sendstr(c, req->type, cfg.serial_dev);
 		break;
 
 	case REQ_SCFG_REPEAT:
@@ -626,11 +2076,45 @@ static int handle_request(struct client *c, struct reqresp *req)
 		sendresp(c, req, 0);
 		break;
 
+	case REQ_GCFG_SHM:
+		if((fds[0] = shm_cfg_fd()) == -1) {
+			sendresp(c, req, -1);
+			break;
+		}
+		req->data[0] = sizeof(struct shm_cfg);
+		if(sendresp_fds(c, req, fds, 1) == -1) {
+			logmsg(LOG_WARNING, "client %s: failed to send the config page descriptor\n", get_client_name(c));
+			sendresp(c, req, -1);
+		}
+		break;
+
+	case REQ_SCFG_BATCH:
+		if((res = recv_str(c, req)) == -1) {
+			logmsg(LOG_ERR, "SCFG_BATCH: failed to receive config batch\n");
+			/* reply once, to the last packet of the batch */
+			if(REQSTR_REMLEN(req) <= REQSTR_CHUNK_SIZE) {
+				req->data[0] = -1;
+				sendresp(c, req, -1);
+			}
+			break;
+		}
+		if(res) {
+			sendresp(c, req, set_cfg_batch(c, req));
+		}
+		break;
+
+	case REQ_GCFG_BATCH:
+		get_cfg_batch(c, req->type);
+		break;
+
 	case REQ_CFG_SAVE:
 		sendresp(c, req, write_cfg(cfgfile, &cfg));
 		break;
 
 	case REQ_CFG_RESTORE:
+		metric_inc(MET_CFG_RELOADS);
+		/* fan-out workers read the output settings, see handle_events */
+		fanout_sync();
 		if(read_cfg(cfgfile, &cfg) == -1) {
 			logmsg(LOG_INFO, "config restore requested but failed to read %s, restoring defaults instead\n",
 					cfgfile);
@@ -641,6 +2125,7 @@ static int handle_request(struct client *c, struct reqresp *req)
 		break;
 
 	case REQ_CFG_RESET:
+		fanout_sync();
 		default_cfg(&cfg);
 		cfg_changed();
 		sendresp(c, req, 0);
@@ -651,6 +2136,10 @@ static int handle_request(struct client *c, struct reqresp *req)
 		sendresp(c, req, -1);
 	}
 
+	/* most configuration requests don't go through cfg_changed */
+	if((req->type & 0xf000) == 0x3000) {
+		shm_cfg_update();
+	}
 	return 0;
 }
 
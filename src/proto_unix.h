@@ -27,8 +27,57 @@ int init_unix(void);
 void close_unix(void);
 int get_unix_socket(void);
 
+#define ENC_CACHE_SIZE	4
+
+struct enc_entry {
+	unsigned int serial;
+	float sens;
+	int32_t data[8];
+};
+
+struct enc_cache {
+	struct enc_entry ent[ENC_CACHE_SIZE];
+	int next;
+	unsigned int serial;
+	long long time;		/* event timestamp (usec) */
+};
+
+/* must be called before sending each new event to clients, with the time it
+ * was generated.
+ */
+void uevent_begin(long long time);
 void send_uevent(spnav_event *ev, struct client *c);
+/* the v1 encoding of the current event with unit sensitivity (main thread) */
+int32_t *uevent_data(spnav_event *ev);
+
+/* same as above, for threads other than the main thread, each with their own
+ * encoded event cache.
+ */
+void enc_begin(struct enc_cache *cache, long long time);
+void send_uevent_enc(spnav_event *ev, struct client *c, struct enc_cache *cache);
+/* queue a message to the client, and send as much as possible right away */
+int send_umsg(struct client *c, const void *data, int size);
+/* same for motion, replacing any older motion the client hasn't received */
+int send_umotion(struct client *c, const void *data, int size);
+/* send an event in the v1 encoding (data[0] is the UEV_* type), which is
+ * wrapped in a timestamped record for protocol v2 clients.
+ */
+int send_uevmsg(struct client *c, const int32_t *data, long long time);
+int send_uevmotion(struct client *c, const int32_t *data, long long time);
+
+/* number of bytes waiting to be sent to the client */
+int uclient_pending(struct client *c);
 
 int handle_uevents(fd_set *rset);
+/* zero while the client's requests are held back, until it reads its output */
+int uclient_reading(struct client *c);
+
+/* write as much of the client output queue as possible */
+void flush_uclient(struct client *c);
+
+/* add clients with pending output to wset, returns the max fd or -1 */
+int uevents_wpending(fd_set *wset);
+/* send pending output, and disconnect clients marked for removal */
+void flush_uevents(void);
 
 #endif	/* PROTO_UNIX_H_ */
@@ -38,9 +38,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "dev.h"
 #include "xdetect.h"
 #include "kbemu.h"
+#include "cfgfile.h"
+#include <X11/Xatom.h>
 
 #ifdef HAVE_XINPUT2_H
-#include <X11/Xatom.h>
 #include <X11/extensions/XInput2.h>
 #endif
 
@@ -52,6 +53,8 @@ enum cmd_msg {
 };
 
 
+static void update_active_window(void);
+static Window find_focus_window(Window active);
 static int xerr(Display *dpy, XErrorEvent *err);
 static int xioerr(Display *dpy);
 
@@ -59,6 +62,15 @@ static Display *dpy;
 static Window win;
 static Atom xa_event_motion, xa_event_bpress, xa_event_brelease;
 static Atom xa_event_devdisc, xa_event_cmd;
+static Atom xa_net_active_window;
+
+/* Focus tracking for cfg.x11_focus. active_win is the top-level window which
+ * the window manager reports in _NET_ACTIVE_WINDOW (None if it doesn't
+ * support it), and focus_win is the magellan client window within it, looked
+ * up lazily on the first event after a focus or client list change.
+ */
+static Window active_win, focus_win;
+static int focus_valid;
 
 /* XXX This stands in for the client sensitivity. Due to the
  * bad design of the original magellan protocol, we can't know
@@ -140,6 +152,7 @@ int init_x11(void)
 	xa_event_brelease = XInternAtom(dpy, "ButtonReleaseEvent", False);
 	xa_event_devdisc = XInternAtom(dpy, "DeviceDisconnectEvent", False);
 	xa_event_cmd = XInternAtom(dpy, "CommandEvent", False);
+	xa_net_active_window = XInternAtom(dpy, "_NET_ACTIVE_WINDOW", False);
 
 	/* Create a dummy window, so that clients are able to send us events
 	 * through the magellan API. No need to map the window.
@@ -169,7 +182,11 @@ int init_x11(void)
 	for(i=0; i<scr_count; i++) {
 		Window root = RootWindow(dpy, i);
 		XChangeProperty(dpy, root, xa_event_cmd, cmd_type, 32, PropModeReplace, (unsigned char*)&win, 1);
+
+		/* follow focus changes through _NET_ACTIVE_WINDOW */
+		XSelectInput(dpy, root, PropertyChangeMask);
 	}
+	update_active_window();
 	XFlush(dpy);
 
 	/* pass the display connection to the keyboard emulation module */
@@ -209,12 +226,10 @@ void close_x11(void)
 	/* also remove all x11 clients from the client list */
 	cnode = first_client();
 	while(cnode) {
-		struct client *c = cnode;
-		cnode = next_client();
-
-		if(get_client_type(c) == CLIENT_X11) {
-			remove_client(c);
+		if(get_client_type(cnode) == CLIENT_X11) {
+			remove_client(cnode);
 		}
+		cnode = next_client(cnode);
 	}
 }
 
@@ -223,46 +238,88 @@ int get_x11_socket(void)
 	return dpy ? ConnectionNumber(dpy) : xdet_get_fd();
 }
 
-void send_xevent(spnav_event *ev, struct client *c)
-{
-	int i;
-	XEvent xevent;
+/* the magellan event for the current fan-out is encoded once, and only the
+ * destination window changes for each client (all X11 clients share x11_sens).
+ */
+static XEvent xev_cache;
+static int xev_cache_valid;
 
-	if(!dpy) return;
+void xevent_begin(void)
+{
+	xev_cache_valid = 0;
+}
 
-	if(setjmp(jbuf)) {
-		return;
-	}
+static int encode_xevent(spnav_event *ev, XEvent *xevent)
+{
+	int i;
 
-	xevent.type = ClientMessage;
-	xevent.xclient.send_event = False;
-	xevent.xclient.display = dpy;
-	xevent.xclient.window = get_client_window(c);
+	memset(xevent, 0, sizeof *xevent);
+	xevent->type = ClientMessage;
+	xevent->xclient.send_event = False;
+	xevent->xclient.display = dpy;
 
 	switch(ev->type) {
 	case EVENT_MOTION:
-		xevent.xclient.message_type = xa_event_motion;
-		xevent.xclient.format = 16;
+		xevent->xclient.message_type = xa_event_motion;
+		xevent->xclient.format = 16;
 
 		for(i=0; i<6; i++) {
 			float val = (float)ev->motion.data[i] * x11_sens;
-			xevent.xclient.data.s[i + 2] = (short)val;
+			xevent->xclient.data.s[i + 2] = (short)val;
 		}
-		xevent.xclient.data.s[0] = xevent.xclient.data.s[1] = 0;
-		xevent.xclient.data.s[8] = ev->motion.period;
+		xevent->xclient.data.s[0] = xevent->xclient.data.s[1] = 0;
+		xevent->xclient.data.s[8] = ev->motion.period;
 		break;
 
 	case EVENT_BUTTON:
-		xevent.xclient.message_type = ev->button.press ? xa_event_bpress : xa_event_brelease;
-		xevent.xclient.format = 16;
-		xevent.xclient.data.s[2] = ev->button.bnum;
+		xevent->xclient.message_type = ev->button.press ? xa_event_bpress : xa_event_brelease;
+		xevent->xclient.format = 16;
+		xevent->xclient.data.s[2] = ev->button.bnum;
 		break;
 
 	default:
+		return -1;
+	}
+	return 0;
+}
+
+void send_xevent(spnav_event *ev, struct client *c)
+{
+	if(!dpy) return;
+
+	if(ev->type != EVENT_MOTION && ev->type != EVENT_BUTTON) {
 		return;
 	}
+	if(ev->type == EVENT_MOTION && !client_wants_motion(c)) {
+		return;
+	}
+
+	if(setjmp(jbuf)) {
+		return;
+	}
+
+	/* with focus-aware delivery, clients in the background only get button
+	 * releases, so that they don't miss the end of a press they've seen.
+	 */
+	if(cfg.x11_focus && active_win) {
+		if(!focus_valid) {
+			focus_win = find_focus_window(active_win);
+			focus_valid = 1;
+		}
+		if(get_client_window(c) != focus_win && (ev->type == EVENT_MOTION || ev->button.press)) {
+			return;
+		}
+	}
+
+	if(!xev_cache_valid) {
+		if(encode_xevent(ev, &xev_cache) == -1) {
+			return;
+		}
+		xev_cache_valid = 1;
+	}
+	xev_cache.xclient.window = get_client_window(c);
 
-	XSendEvent(dpy, get_client_window(c), False, 0, &xevent);
+	XSendEvent(dpy, get_client_window(c), False, 0, &xev_cache);
 	XFlush(dpy);
 }
 
@@ -303,6 +360,8 @@ int handle_xevents(fd_set *rset)
 				default:
 					break;
 				}
+			} else if(xev.type == PropertyNotify && xev.xproperty.atom == xa_net_active_window) {
+				update_active_window();
 			}
 		}
 	}
@@ -314,7 +373,6 @@ int handle_xevents(fd_set *rset)
 void set_client_window(Window win)
 {
 	int i, scr_count;
-	struct client *cnode;
 
 	/* When a magellan application exits, the SDK sets another window to avoid
 	 * crashing the original proprietary daemon.  The new free SDK will set
@@ -329,30 +387,97 @@ void set_client_window(Window win)
 	}
 
 	/* make sure we don't already have that client */
-	cnode = first_client();
-	while(cnode) {
-		if(get_client_window(cnode) == win) {
-			return;
-		}
-		cnode = next_client();
+	if(find_client_window(win)) {
+		return;
 	}
 
 	add_client(CLIENT_X11, &win);
+	focus_valid = 0;
 }
 
-void remove_client_window(Window win)
+/* reads the top-level window with the input focus from _NET_ACTIVE_WINDOW */
+static void update_active_window(void)
 {
-	struct client *c, *cnode;
+	int i, scr_count, fmt;
+	Atom type;
+	unsigned long count, rem;
+	unsigned char *prop;
+	Window prev = active_win;
 
-	cnode = first_client();
-	while(cnode) {
-		c = cnode;
-		cnode = next_client();
+	active_win = None;
 
-		if(get_client_window(c) == win) {
-			remove_client(c);
-			return;
+	scr_count = ScreenCount(dpy);
+	for(i=0; i<scr_count; i++) {
+		if(XGetWindowProperty(dpy, RootWindow(dpy, i), xa_net_active_window, 0, 1,
+					False, XA_WINDOW, &type, &fmt, &count, &rem, &prop) != Success) {
+			continue;
+		}
+		if(prop) {
+			if(type == XA_WINDOW && fmt == 32 && count) {
+				active_win = *(Window*)prop;
+			}
+			XFree(prop);
 		}
+		if(active_win) break;
+	}
+
+	if(active_win != prev) {
+		focus_valid = 0;
+		if(verbose && cfg.x11_focus) {
+			logmsg(LOG_INFO, "active window: %x\n", (unsigned int)active_win);
+		}
+	}
+}
+
+/* non-zero if win is top, or one of its descendants */
+static int window_within(Window win, Window top)
+{
+	Window root, parent, *children;
+	unsigned int nchildren;
+
+	while(win != top) {
+		if(!XQueryTree(dpy, win, &root, &parent, &children, &nchildren)) {
+			return 0;
+		}
+		if(children) {
+			XFree(children);
+		}
+		if(!parent || parent == root) {
+			return 0;
+		}
+		win = parent;
+	}
+	return 1;
+}
+
+/* finds the magellan client window which belongs to the active top-level window */
+static Window find_focus_window(Window active)
+{
+	struct client *c;
+	Window cwin;
+
+	c = first_client();
+	while(c) {
+		if(get_client_type(c) == CLIENT_X11) {
+			cwin = get_client_window(c);
+			if(window_within(cwin, active)) {
+				if(verbose) {
+					logmsg(LOG_INFO, "focused client window: %x\n", (unsigned int)cwin);
+				}
+				return cwin;
+			}
+		}
+		c = next_client(c);
+	}
+	return None;
+}
+
+void remove_client_window(Window win)
+{
+	struct client *c;
+
+	if((c = find_client_window(win))) {
+		remove_client(c);
 	}
 }
 
@@ -31,6 +31,8 @@ void close_x11(void);
 
 int get_x11_socket(void);
 
+/* must be called before sending each new event to clients */
+void xevent_begin(void);
 void send_xevent(spnav_event *ev, struct client *c);
 int handle_xevents(fd_set *rset);
 
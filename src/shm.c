@@ -0,0 +1,486 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef __linux__
+#define _GNU_SOURCE	/* memfd_create, file sealing */
+#endif
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "shm.h"
+#include "spnavd.h"
+#include "proto.h"
+#include "proto_unix.h"
+#include "cfgfile.h"
+
+#ifdef USE_SHM
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#define RING_SLOTS	1024
+
+static int init_ring(void);
+
+/* the ring is created on first use, and kept around until the daemon exits */
+static int ring_fd = -1;
+static struct shm_ring_hdr *ring;
+static struct shm_rec *ring_slots;
+static uint64_t ring_head, ring_woken;
+
+static struct client **ring_clients;
+static int num_ring_clients, max_ring_clients;
+
+static int cfg_fd = -1;
+static struct shm_cfg *cfg_page;
+
+
+/* Reopens a shared memory object read-only, through /proc/self/fd, after
+ * taking write permission away from its inode. Memory objects are created
+ * with all permissions, so otherwise a client could reopen its descriptor for
+ * writing the same way.
+ */
+static int reopen_rdonly(int fd)
+{
+	int rdfd;
+	char path[64];
+
+	if(fchmod(fd, 0444) == -1) {
+		logmsg(LOG_ERR, "failed to make shared memory object read-only: %s\n", strerror(errno));
+		return -1;
+	}
+	sprintf(path, "/proc/self/fd/%d", fd);
+	if((rdfd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+		logmsg(LOG_ERR, "failed to reopen shared memory object read-only: %s\n", strerror(errno));
+		return -1;
+	}
+	close(fd);
+	return rdfd;
+}
+
+int shm_create(const char *name, int size, void **mem)
+{
+	int fd, rdfd, seals;
+	void *ptr;
+
+	if((fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+		logmsg(LOG_ERR, "failed to create shared memory object: %s\n", strerror(errno));
+		return -1;
+	}
+	if(ftruncate(fd, size) == -1) {
+		logmsg(LOG_ERR, "failed to resize shared memory object: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+	if((ptr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		logmsg(LOG_ERR, "failed to map shared memory object: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/* fix the size, and now that our own mapping exists, disallow any new
+	 * writable mappings. Clients get the descriptor, and must never be able to
+	 * write to what other clients read.
+	 */
+	seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+	if(fcntl(fd, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE) != -1) {
+		*mem = ptr;
+		return fd;
+	}
+#endif
+	/* older kernels can't do the latter, hand out a read-only descriptor */
+	if(fcntl(fd, F_ADD_SEALS, seals) == -1) {
+		logmsg(LOG_WARNING, "failed to seal shared memory object: %s\n", strerror(errno));
+	}
+	if((rdfd = reopen_rdonly(fd)) == -1) {
+		munmap(ptr, size);
+		close(fd);
+		return -1;
+	}
+
+	*mem = ptr;
+	return rdfd;
+}
+
+void shm_destroy(int fd, void *mem, int size)
+{
+	if(mem) {
+		munmap(mem, size);
+	}
+	if(fd >= 0) {
+		close(fd);
+	}
+}
+
+static int init_ring(void)
+{
+	int size = (RING_SLOTS + 1) * sizeof(struct shm_rec);
+
+	if((ring_fd = shm_create("spnav-ring", size, (void**)&ring)) == -1) {
+		return -1;
+	}
+	ring->magic = SHM_RING_MAGIC;
+	ring->num_slots = RING_SLOTS;
+	ring->slot_size = sizeof(struct shm_rec);
+	ring_slots = (struct shm_rec*)((char*)ring + ring->slot_size);
+	return 0;
+}
+
+int shm_ring_attach(struct client *c, int *fds)
+{
+	int evfd, newsz;
+	struct client **tmp;
+
+	if(!c->ring) {
+		if(ring_fd == -1 && init_ring() == -1) {
+			return -1;
+		}
+
+		if(num_ring_clients >= max_ring_clients) {
+			newsz = max_ring_clients ? max_ring_clients * 2 : 8;
+			if(!(tmp = realloc(ring_clients, newsz * sizeof *ring_clients))) {
+				return -1;
+			}
+			ring_clients = tmp;
+			max_ring_clients = newsz;
+		}
+
+		if((evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			logmsg(LOG_ERR, "failed to create eventfd: %s\n", strerror(errno));
+			return -1;
+		}
+		ring_clients[num_ring_clients++] = c;
+		c->cold->ring_evfd = evfd;
+		c->ring = 1;
+	}
+
+	fds[0] = ring_fd;
+	fds[1] = c->cold->ring_evfd;
+	return 0;
+}
+
+void shm_ring_detach(struct client *c)
+{
+	int i;
+
+	if(!c->ring) return;
+
+	for(i=0; i<num_ring_clients; i++) {
+		if(ring_clients[i] == c) {
+			ring_clients[i] = ring_clients[--num_ring_clients];
+			break;
+		}
+	}
+	close(c->cold->ring_evfd);
+	c->ring = 0;
+}
+
+int shm_ring_slots(void)
+{
+	return RING_SLOTS;
+}
+
+/* The ring carries the events selected by any of its clients, and motion only
+ * while no client holds an exclusive active claim. Ring clients can't select
+ * events per device, or only while active (see REQ_SET_TRANSPORT).
+ */
+static int ring_wants(spnav_event *ev)
+{
+	int i;
+	unsigned int mask = 0, evbit = event_evmask(ev->type);
+
+	for(i=0; i<num_ring_clients; i++) {
+		mask |= ring_clients[i]->evmask;
+	}
+	if(!(mask & evbit)) {
+		return 0;
+	}
+	if(ev->type == EVENT_MOTION && get_active_client() && (get_active_flags() & ACTIVE_EXCLUSIVE)) {
+		return 0;
+	}
+	return 1;
+}
+
+/* Single producer: the slot seq is cleared before the record is written, and
+ * set again afterwards, so that readers can detect records overwritten while
+ * they were copying them (see the description in proto.h).
+ */
+void shm_ring_publish(spnav_event *ev, struct device *dev, long long time)
+{
+	struct shm_rec *rec;
+	int32_t *data;
+	uint64_t seq;
+
+	if(!num_ring_clients || !ring_wants(ev) || !(data = uevent_data(ev))) {
+		return;
+	}
+
+	seq = ++ring_head;
+	rec = ring_slots + seq % RING_SLOTS;
+
+	__atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	rec->time = time;
+	rec->type = data[0];
+	rec->dev = dev ? dev->id : -1;
+	memcpy(rec->data, data + 1, sizeof rec->data);
+
+	__atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, seq, __ATOMIC_RELEASE);
+
+	if(cfg.client_flush == FLUSH_IMMEDIATE) {
+		shm_ring_wake();
+	}
+}
+
+void shm_ring_wake(void)
+{
+	int i;
+	uint64_t one = 1;
+
+	if(ring_woken == ring_head) return;
+	ring_woken = ring_head;
+
+	/* a full eventfd counter just means the client has a wakeup pending */
+	for(i=0; i<num_ring_clients; i++) {
+		while(write(ring_clients[i]->cold->ring_evfd, &one, sizeof one) == -1 && errno == EINTR);
+	}
+}
+
+
+int shm_devstate_fd(struct device *dev)
+{
+	struct shm_devstate *st;
+	int fd;
+
+	if(dev->state) {
+		return dev->state_fd;
+	}
+
+	if((fd = shm_create("spnav-devstate", sizeof *st, (void**)&st)) == -1) {
+		return -1;
+	}
+	st->magic = SHM_DEVSTATE_MAGIC;
+	st->dev = dev->id;
+	st->num_axes = dev->num_axes;
+	st->num_buttons = dev->num_buttons;
+	/* start from the raw values of the last complete frame */
+	memcpy(st->raw, dev->rawframe, sizeof st->raw);
+
+	dev->state = st;
+	dev->state_fd = fd;
+	return fd;
+}
+
+void shm_devstate_destroy(struct device *dev)
+{
+	if(!dev->state) return;
+
+	/* clients keep their mappings, let them know there won't be any updates */
+	__atomic_store_n(&dev->state->removed, 1, __ATOMIC_RELEASE);
+
+	shm_destroy(dev->state_fd, dev->state, sizeof *dev->state);
+	dev->state = 0;
+	dev->state_fd = -1;
+}
+
+/* seqlock write side, readers retry while seq is odd or changes */
+static void state_begin(struct shm_devstate *st)
+{
+	__atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void state_end(struct shm_devstate *st, long long time)
+{
+	st->generation++;
+	st->time = time;
+	__atomic_store_n(&st->seq, st->seq + 1, __ATOMIC_RELEASE);
+}
+
+void shm_devstate_motion(struct device *dev, const int *motion, long long time)
+{
+	struct shm_devstate *st = dev->state;
+	int i;
+
+	if(!st) return;
+
+	state_begin(st);
+	for(i=0; i<6; i++) {
+		st->motion[i] = motion[i];
+	}
+	state_end(st, time);
+}
+
+void shm_devstate_raw(struct device *dev, const int32_t *raw, int count, long long time)
+{
+	struct shm_devstate *st = dev->state;
+
+	if(!st) return;
+	if(count > SHM_DEVSTATE_AXES) count = SHM_DEVSTATE_AXES;
+
+	state_begin(st);
+	memcpy(st->raw, raw, count * sizeof *raw);
+	state_end(st, time);
+}
+
+void shm_devstate_button(struct device *dev, int bnum, int press, long long time)
+{
+	struct shm_devstate *st = dev->state;
+	uint32_t bit;
+
+	if(!st || bnum < 0 || bnum >= 64) return;
+
+	bit = 1u << (bnum & 31);
+	state_begin(st);
+	if(press) {
+		st->buttons[bnum >> 5] |= bit;
+	} else {
+		st->buttons[bnum >> 5] &= ~bit;
+	}
+	state_end(st, time);
+}
+
+int shm_cfg_fd(void)
+{
+	if(cfg_fd == -1) {
+		if((cfg_fd = shm_create("spnav-cfg", sizeof *cfg_page, (void**)&cfg_page)) == -1) {
+			return -1;
+		}
+		cfg_page->magic = SHM_CFG_MAGIC;
+		shm_cfg_update();
+	}
+	return cfg_fd;
+}
+
+#define CPY_ARRAY(dest, src) \
+	memcpy(dest, src, (sizeof dest < sizeof src ? sizeof dest : sizeof src))
+
+void shm_cfg_update(void)
+{
+	int i;
+	static struct shm_cfg snap;
+
+	if(!cfg_page) return;
+
+	memset(&snap, 0, sizeof snap);
+	snap.sensitivity = cfg.sensitivity;
+	CPY_ARRAY(snap.sens_trans, cfg.sens_trans);
+	CPY_ARRAY(snap.sens_rot, cfg.sens_rot);
+	snap.swapyz = cfg.swapyz;
+	snap.led = cfg.led;
+	snap.grab = cfg.grab_device;
+	snap.repeat_msec = cfg.repeat_msec;
+	CPY_ARRAY(snap.dead_threshold, cfg.dead_threshold);
+	CPY_ARRAY(snap.invert, cfg.invert);
+	CPY_ARRAY(snap.map_axis, cfg.map_axis);
+	CPY_ARRAY(snap.map_button, cfg.map_button);
+	CPY_ARRAY(snap.bnact, cfg.bnact);
+	CPY_ARRAY(snap.kbmap_count, cfg.kbmap_count);
+	for(i=0; i<SHM_CFG_BUTTONS && i<MAX_BUTTONS; i++) {
+		CPY_ARRAY(snap.kbmap[i], cfg.kbmap[i]);
+	}
+	for(i=0; i<sizeof snap.serial_dev - 1 && cfg.serial_dev[i]; i++) {
+		snap.serial_dev[i] = cfg.serial_dev[i];
+	}
+
+	/* compare everything after the header */
+	if(memcmp(&snap.sensitivity, &cfg_page->sensitivity,
+				sizeof snap - offsetof(struct shm_cfg, sensitivity)) == 0) {
+		return;
+	}
+
+	__atomic_store_n(&cfg_page->seq, cfg_page->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&cfg_page->sensitivity, &snap.sensitivity,
+			sizeof snap - offsetof(struct shm_cfg, sensitivity));
+	cfg_page->generation++;
+	__atomic_store_n(&cfg_page->seq, cfg_page->seq + 1, __ATOMIC_RELEASE);
+}
+
+#else	/* !USE_SHM */
+
+int shm_create(const char *name, int size, void **mem)
+{
+	return -1;
+}
+
+void shm_destroy(int fd, void *mem, int size)
+{
+}
+
+int shm_ring_attach(struct client *c, int *fds)
+{
+	logmsg(LOG_WARNING, "spacenavd was built without shared memory support\n");
+	return -1;
+}
+
+void shm_ring_detach(struct client *c)
+{
+}
+
+int shm_ring_slots(void)
+{
+	return 0;
+}
+
+void shm_ring_publish(spnav_event *ev, struct device *dev, long long time)
+{
+}
+
+void shm_ring_wake(void)
+{
+}
+
+int shm_devstate_fd(struct device *dev)
+{
+	return -1;
+}
+
+void shm_devstate_destroy(struct device *dev)
+{
+}
+
+void shm_devstate_motion(struct device *dev, const int *motion, long long time)
+{
+}
+
+void shm_devstate_raw(struct device *dev, const int32_t *raw, int count, long long time)
+{
+}
+
+void shm_devstate_button(struct device *dev, int bnum, int press, long long time)
+{
+}
+
+int shm_cfg_fd(void)
+{
+	return -1;
+}
+
+void shm_cfg_update(void)
+{
+}
+
+#endif	/* USE_SHM */
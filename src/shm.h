@@ -0,0 +1,69 @@
+/*
+spacenavd - a free software replacement driver for 6dof space-mice.
+Copyright (C) 2007-2025 John Tsiombikas <nuclear@mutantstargoat.com>
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SHM_H_
+#define SHM_H_
+
+#include "config.h"
+#include "event.h"
+#include "client.h"
+
+#if defined(HAVE_MEMFD_CREATE) && defined(HAVE_EVENTFD)
+#define USE_SHM
+#endif
+
+/* Shared memory objects passed to clients over the UNIX socket. They are
+ * backed by sealed memfds, which clients can only map read-only.
+ *
+ * Without USE_SHM, creating one always fails.
+ */
+int shm_create(const char *name, int size, void **mem);
+void shm_destroy(int fd, void *mem, int size);
+
+/* Shared event ring transport. Attaching a client returns the ring memfd in
+ * fds[0] and the client's wakeup eventfd in fds[1], which remain owned by the
+ * shm module.
+ */
+int shm_ring_attach(struct client *c, int *fds);
+void shm_ring_detach(struct client *c);
+int shm_ring_slots(void);
+
+/* write an event into the ring, dev is the originating device or null */
+void shm_ring_publish(spnav_event *ev, struct device *dev, long long time);
+/* signal the attached clients, if anything was written since the last wakeup */
+void shm_ring_wake(void);
+
+/* Shared device state pages. The page is created on the first call to
+ * shm_devstate_fd, and the update functions do nothing for devices without
+ * one.
+ */
+int shm_devstate_fd(struct device *dev);
+void shm_devstate_destroy(struct device *dev);
+
+void shm_devstate_motion(struct device *dev, const int *motion, long long time);
+/* raw values of the first count axes, as of the latest input frame */
+void shm_devstate_raw(struct device *dev, const int32_t *raw, int count, long long time);
+void shm_devstate_button(struct device *dev, int bnum, int press, long long time);
+
+/* Shared configuration page. Once it's created by the first call to
+ * shm_cfg_fd, shm_cfg_update rewrites it whenever the configuration differs
+ * from the last published snapshot, and is cheap to call otherwise.
+ */
+int shm_cfg_fd(void);
+void shm_cfg_update(void);
+
+#endif	/* SHM_H_ */
@@ -24,6 +24,7 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -35,6 +36,10 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #include "client.h"
 #include "proto_unix.h"
 #include "kbemu.h"
+#include "deliver.h"
+#include "fanout.h"
+#include "shm.h"
+#include "metrics.h"
 #ifdef USE_X11
 #include "proto_x11.h"
 #endif
@@ -45,7 +50,7 @@ static void redir_log(int fallback_syslog);
 static void daemonize(void);
 static int write_pid_file(void);
 static int find_running_daemon(void);
-static void handle_events(fd_set *rset);
+static int handle_events(fd_set *rset);
 static void sig_handler(int s);
 static char *fix_path(char *str);
 
@@ -59,6 +64,7 @@ int main(int argc, char **argv)
 {
 	int i, pid, ret, become_daemon = 1;
 	int force_logfile = 0;
+	long long repeat_due = 0;
 
 	for(i=1; i<argc; i++) {
 		if(argv[i][0] == '-') {
@@ -177,21 +183,24 @@ opt_pidfile:		if(!argv[++i]) {
 	init_devices();
 	init_hotplug();
 
+	init_fanout(cfg.fanout_threads);
 	init_unix();
 #ifdef USE_X11
 	init_x11();
 #endif
 	kbemu_init();
+	init_deliver();
 
 	atexit(cleanup);
 
 	for(;;) {
-		fd_set rset;
+		fd_set rset, wset;
 		int fd, max_fd = 0;
 		struct client *client_iter;
 		struct device *dev;
 
 		FD_ZERO(&rset);
+		FD_ZERO(&wset);
 
 		dev = get_devices();
 		while(dev) {
@@ -216,14 +225,18 @@ opt_pidfile:		if(!argv[++i]) {
 		/* all the UNIX socket clients */
 		client_iter = first_client();
 		while(client_iter) {
-			if(get_client_type(client_iter) == CLIENT_UNIX) {
+			if(get_client_type(client_iter) == CLIENT_UNIX && uclient_reading(client_iter)) {
 				int s = get_client_socket(client_iter);
 				assert(s >= 0);
 
 				FD_SET(s, &rset);
 				if(s > max_fd) max_fd = s;
 			}
-			client_iter = next_client();
+			client_iter = next_client(client_iter);
+		}
+		/* ... and the ones we have pending output for */
+		if((fd = uevents_wpending(&wset)) > max_fd) {
+			max_fd = fd;
 		}
 
 		/* and the X server socket */
@@ -234,6 +247,12 @@ opt_pidfile:		if(!argv[++i]) {
 		}
 #endif
 
+		/* the per-client delivery timer */
+		if((fd = get_deliver_fd()) != -1) {
+			FD_SET(fd, &rset);
+			if(fd > max_fd) max_fd = fd;
+		}
+
 		/* also the self-pipe read-end for safe SIGHUP handling */
 		FD_SET(pfd[0], &rset);
 		if(pfd[0] > max_fd) max_fd = fd;
@@ -243,35 +262,68 @@ opt_pidfile:		if(!argv[++i]) {
 			 * wait for only as long as specified in cfg.repeat_msec
 			 */
 			struct timeval tv, *timeout = 0;
+			long long wait_usec = -1, deliv_usec, stats_usec;
+
 			if(cfg.repeat_msec >= 0) {
 				dev = get_devices();
 				while(dev) {
 					if(is_device_valid(dev) && !in_deadzone(dev)) {
-						tv.tv_sec = cfg.repeat_msec / 1000;
-						tv.tv_usec = cfg.repeat_msec % 1000;
-						timeout = &tv;
+						if(!repeat_due) {
+							repeat_due = get_usec() + cfg.repeat_msec * 1000LL;
+						}
+						if((wait_usec = repeat_due - get_usec()) < 0) {
+							wait_usec = 0;
+						}
 						break;
 					}
 					dev = dev->next;
 				}
+				if(!dev) repeat_due = 0;
+			}
+
+			/* wake up in time for any pending per-client motion deliveries */
+			if((deliv_usec = deliver_timeout()) >= 0) {
+				if(wait_usec < 0 || deliv_usec < wait_usec) {
+					wait_usec = deliv_usec;
+				}
+			}
+			/* ... and to write out the last counter changes to the stats file */
+			if((stats_usec = metrics_timeout()) >= 0) {
+				if(wait_usec < 0 || stats_usec < wait_usec) {
+					wait_usec = stats_usec;
+				}
+			}
+
+			if(wait_usec >= 0) {
+				tv.tv_sec = wait_usec / 1000000;
+				tv.tv_usec = wait_usec % 1000000;
+				timeout = &tv;
 			}
 
-			ret = select(max_fd + 1, &rset, 0, 0, timeout);
+			ret = select(max_fd + 1, &rset, &wset, 0, timeout);
 		} while(ret == -1 && errno == EINTR);
 
-		if(ret > 0) {
-			handle_events(&rset);
-		} else {
-			if(cfg.repeat_msec >= 0) {
-				dev = get_devices();
-				while(dev) {
-					if(!in_deadzone(dev)) {
-						repeat_last_event(dev);
-					}
-					dev = dev->next;
+		/* only device input restarts the repeat interval, the delivery timer,
+		 * client sockets and X events must not keep pushing it back.
+		 */
+		if(ret > 0 && handle_events(&rset)) {
+			repeat_due = 0;
+		}
+		if(repeat_due && get_usec() >= repeat_due) {
+			dev = get_devices();
+			while(dev) {
+				if(!in_deadzone(dev)) {
+					repeat_last_event(dev);
 				}
+				dev = dev->next;
 			}
+			repeat_due = 0;
 		}
+
+		deliver_pending();
+		flush_uevents();
+		reap_clients();
+		metrics_write_file();
 	}
 	return 0;	/* unreachable */
 }
@@ -298,7 +350,9 @@ static void cleanup(void)
 #ifdef USE_X11
 	close_x11();	/* call to avoid leaving garbage in the X server's root windows */
 #endif
+	shutdown_fanout();
 	close_unix();
+	close_deliver();
 
 	shutdown_hotplug();
 
@@ -419,9 +473,10 @@ static int find_running_daemon(void)
 	return pid;
 }
 
-static void handle_events(fd_set *rset)
+/* returns non-zero if there was any device input */
+static int handle_events(fd_set *rset)
 {
-	int dev_fd, hotplug_fd;
+	int dev_fd, hotplug_fd, dev_input = 0;
 	struct device *dev;
 	struct dev_input inp;
 
@@ -430,8 +485,13 @@ static void handle_events(fd_set *rset)
 		int tmp;
 		read(pfd[0], &tmp, sizeof tmp);	/* eat up the junk char */
 
+		/* fan-out workers read the output settings, and read_cfg starts by
+		 * resetting everything to the defaults.
+		 */
+		fanout_sync();
 		read_cfg(cfgfile, &cfg);
 		cfg_changed();
+		metric_inc(MET_CFG_RELOADS);
 	}
 
 	/* handle anything coming through the UNIX socket */
@@ -453,12 +513,15 @@ static void handle_events(fd_set *rset)
 		if((dev_fd = get_device_fd(dev)) != -1 && FD_ISSET(dev_fd, rset)) {
 			/* read an event from the device ... */
 			while(read_device(dev, &inp) != -1) {
+				dev->num_inputs++;
+				metric_inc(MET_INPUTS);
 				/* ... and process it, possibly dispatching a spacenav event to clients */
 				process_input(dev, &inp);
 			}
 			/* flush any pending events if we run out of input */
 			inp.type = INP_FLUSH;
 			process_input(dev, &inp);
+			dev_input = 1;
 		}
 		dev = next;
 	}
@@ -468,6 +531,7 @@ static void handle_events(fd_set *rset)
 			handle_hotplug();
 		}
 	}
+	return dev_input;
 }
 
 void cfg_changed(void)
@@ -501,9 +565,17 @@ void cfg_changed(void)
 		init_devices_serial();
 	}
 
+	shm_cfg_update();
 	prev_cfg = cfg;
 }
 
+long long get_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 /* signals usr1 & usr2 are sent by the spnav_x11 script to start/stop the
  * daemon's connection to the X server.
  */
@@ -58,4 +58,7 @@ extern char *cfgfile;
 
 void cfg_changed(void);
 
+/* monotonic time in microseconds */
+long long get_usec(void);
+
 #endif	/* SPNAVD_H_ */